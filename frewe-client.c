@@ -65,8 +65,30 @@
  * 2016-01-16 Separate read interval for fhem.txt, run each 48 seconds for FHEM
  * 2017-03-27 Calculated Outside Humidity can be a maximum of 100 Percent
  * 2024-01-24 Awekas URL
-
- * TODO: Handle rain counter overflow
+ * 2026-10-16 Keep the USB device open across cycles (ws_session), reconnect only on failed transfers
+ * 2026-10-16 Read the history ring in one sequential sweep of 32 byte blocks into an in-memory image (ws_read_ring)
+ * 2026-10-16 Keep the memory image in a mmap'ed shadow file, read only records written since the last cycle (ws_sync)
+ * 2026-10-16 Selectable read verification (ReadVerify Double/Plausi), USB read statistics
+ * 2026-10-16 LRU cache of decoded rain counters keyed by record address (ws_cache_rain)
+ * 2026-10-16 Optional libusb-1.0 build (HAVE_LIBUSB1) with queued asynchronous transfers in ws_read
+ * 2026-10-16 libusb-1.0: follow USB hotplug events, suspend reads while the station is gone, catch up on arrival
+ * 2026-10-16 Station backends (struct wbackend): USB and a simulator serving a memory image file (-S)
+ * 2026-10-16 -d export formats log/hex/bin/rec to a file or stdout, streamed in chunks with buffered writes, fix quadratic ws_dump
+ * 2026-10-16 RunSchedule Aligned: learn the write phase of the station, poll the position pointer just after each expected write
+ * 2026-10-16 Reentrant batch decoder ws_decode() with error bits per record and struct wcontext, ws_parse() wraps it
+ * 2026-10-16 Rain index with cumulative rain and record times replaces the rain cache, rain counter overflow is handled
+ * 2026-10-16 Exact record times from the age chain (ws_time_build), resume after frewe-server lasttime by lookup
+ * 2026-10-16 Compile ws_format() templates once into op lists (ws_compile, ws_exec)
+ * 2026-10-16 String builder (struct wbuf) for ws_format(), alarms and error URLs, output is formatted in linear time
+ * 2026-10-16 Table driven URL encoder/decoder writing into the caller's buffer, SSE2 copies unreserved runs
+ * 2026-10-16 Per record view (ws_view) renders each placeholder once for all destinations
+ * 2026-10-16 Integer only number formatting (ws_ftoa, ws_itoa) for placeholders, same output as printf
+ * 2026-10-16 Bulk output -o csv|json|bin (BulkOutput cfg) of all records of a cycle, -p from:to reads a range
+ * 2026-10-16 HTTP/1.1 keep-alive connection pool in http_fetcher.c, Content-Length and chunked bodies
+ * 2026-10-16 Resolver cache in http_fetcher.c with TTL (DNSCacheTTL cfg), failed lookups cached briefly, last good address on resolver outage
+ * 2026-10-16 Submissions to the weather services and additional URLs of a record run concurrently (http_fetch_multi, epoll)
+ * 2026-10-16 http_fetcher.c reads responses in blocks instead of a read() per header byte, case insensitive header fields
+ * 2026-10-16 frewe-server replies go into a fixed buffer, replies of weather services, alarms and errors are dropped unread (http_fetch_buf, discard mode)
  */
 
 // #define _XOPEN_SOURCE 1 /* was needed for strptime? */
@@ -76,11 +98,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <signal.h>
+#ifdef HAVE_LIBUSB1
+#include <libusb.h>
+#else
 #include <usb.h>
+#endif
 #include <time.h>
 #include <math.h>
 #include <elf.h> 
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <openssl/md5.h>
 #include "http_fetcher.h"
 
@@ -100,22 +136,136 @@
 #define WS_MAX_ENTRY_ADDR 0x10000
 #define WS_TOTAL_ENTRIES ((WS_MAX_ENTRY_ADDR-WS_MIN_ENTRY_ADDR)/ws_entry_size)
 
+#define WS_BLOCK_SIZE 0x20		// The station answers each read command with one 32 byte block
+#define WS_READ_CHUNK 0x1000		// Bulk reads are split in chunks, a failed chunk is retried after reconnect
+
 #define MAX_ALARMS	20
 #define MAX_ADD_URLS	10
 
 // extern double round (double __x) __attribute__ ((__nothrow__)) __attribute__ ((__const__));
 
+#ifdef HAVE_LIBUSB1
+typedef libusb_device_handle usb_dev_handle;
+
+#define WS_QUEUE_DEPTH 4		// Interrupt reads armed ahead of their read commands
+#endif
+
+// Station backends, the USB station and a simulator
+
+struct wsession;
+
+struct wbackend
+{	char *name;
+	int (*open)(struct wsession *s);
+	int (*read)(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size);
+	void (*close)(struct wsession *s);
+};
+
+// Simulator state, serves a memory image loaded from file. New records are written every read period
+// of the simulated clock, which runs speed times faster than the real one
+
+struct wsim
+{	char *file;
+	double speed;
+	uint8_t mem[WS_MAX_ENTRY_ADDR];
+	time_t start;				// Real time the image was loaded
+	int age0;				// Age of the current record in the file
+	int written;				// Records written by the simulation
+};
+
+// Long-lived session, the device is opened on first use and kept open across cycles
+
+struct wsession
+{	struct wbackend *backend;
+	usb_dev_handle *dev;			// USB backend
+	struct wsim *sim;			// Simulator backend
+	char isopen;
+	int opens,reconnects;
+	char catchup;				// Last read failed, read again as soon as the station is back
+	char gone,arrived;			// Set by USB hotplug events (libusb-1.0 only)
+	char hotplug;				// Hotplug callback is registered (1) or not available (-1)
+};
+
 int ws_open(usb_dev_handle **dev,uint16_t vendor,uint16_t product,int reset_done);
 int ws_close(usb_dev_handle **dev);
 int ws_read(usb_dev_handle *dev,uint16_t address,uint8_t *data,uint16_t size);
 int ws_reset(usb_dev_handle *dev);
-int ws_format(char *format, char *output, unsigned char urlencode, char *user, char *pass, char *error);
+int ws_verify_double(uint16_t address,uint8_t *block,uint16_t size);
+int ws_verify_plausi(uint16_t address,uint8_t *block,uint16_t size);
+int ws_plausible(uint8_t *rec,int from,int to);
+int ws_session_read(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size);
+void ws_session_close(struct wsession *s);
+int ws_session_wait(struct wsession *s);
+int ws_usb_open(struct wsession *s);
+int ws_usb_read(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size);
+void ws_usb_close(struct wsession *s);
+int ws_sim_open(struct wsession *s);
+int ws_sim_read(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size);
+void ws_sim_close(struct wsession *s);
+void ws_sim_advance(struct wsim *m);
+#ifdef HAVE_LIBUSB1
+void ws_hotplug_init(struct wsession *s);
+#endif
+int ws_read_span(struct wsession *s,uint32_t from,uint32_t to,uint8_t *image);
+int ws_read_ring(struct wsession *s,uint16_t address,int count,uint8_t *image);
+int ws_sync(struct wsession *s,uint16_t address,int lowpos,int data_count,time_t curtime);
+int ws_image_open(char *fname);
+void ws_image_flush(void);
+struct wtimes;
+struct wrain;
+void ws_time_build(struct wtimes *x,uint16_t address,int lowpos,int data_count,time_t curtime,int last_age);
+int ws_time_find(struct wtimes *x,time_t t);
+void ws_rain_build(struct wrain *r,struct wtimes *x,uint16_t address);
+float ws_rain_last(struct wrain *r,int position,int minutes);
+float ws_rain_since0h(struct wrain *r,int position);
+time_t ws_rec_time(int position,time_t curtime,int last_age);
+void ws_sched_learn(uint16_t address,int last_age,time_t curtime);
+int ws_sched_poll(struct wsession *s);
+int ws_pos60(int curpos,int last_age,int data_count);
+int ws_pos0h(int curpos,int last_age,int data_count,struct tm *tmptr);
+int ws_parse(uint8_t *buffer, float rainhour, float rainday, time_t curtime, int position, int last_age);
+int ws_format(char *format, char **output, unsigned char urlencode, char *user, char *pass, char *error);
+struct wprog *ws_compile(char *format, unsigned char urlencode);
+struct wprog *ws_program(char *format, unsigned char urlencode);
+struct wbuf;
+int ws_exec(struct wprog *prog, struct wbuf *b, char *user, char *pass, char *error);
+struct wfield;
+void ws_view_reset(void);
+int ws_itoa(char *out, long v);
+int ws_ftoa(char *out, float v, int dec);
+char *ws_view_text(struct wfield *f, unsigned char urlencode, int *len);
+void ws_buf_init(struct wbuf *b, size_t size);
+int ws_buf_grow(struct wbuf *b, size_t n);
+void ws_buf_put(struct wbuf *b, char *text, size_t n);
+void ws_buf_puts(struct wbuf *b, char *text);
+void ws_buf_putenc(struct wbuf *b, char *text, unsigned char urlencode);
+void ws_buf_vprintf(struct wbuf *b, char *fmt, va_list args);
+void ws_buf_printf(struct wbuf *b, char *fmt, ...);
+char *ws_buf_done(struct wbuf *b);
 int ws_dump(uint16_t address,uint8_t *buffer,uint16_t size,uint8_t width);
+int ws_export(struct wsession *s,uint32_t address,uint32_t size,char *format,char *file);
+int ws_export_log(FILE *fp,uint32_t address,uint8_t *data,uint32_t size);
+int ws_export_hex(FILE *fp,uint32_t address,uint8_t *data,uint32_t size);
+int ws_export_bin(FILE *fp,uint32_t address,uint8_t *data,uint32_t size);
+int ws_export_rec(FILE *fp,uint32_t address,uint8_t *data,uint32_t size);
+void ws_stdout_buffer(void);
+int ws_submit(char *server_url, char *reply, int size);
+int ws_submit_add(char *url);
+int ws_submit_all(void);
+struct woutput;
+struct wrecord;
+int ws_output(struct woutput *o,uint16_t address,int startpos,int endpos,time_t curtime,int last_age);
+int ws_output_csv(FILE *fp,struct wrecord *r,int n);
+int ws_output_json(FILE *fp,struct wrecord *r,int n);
+int ws_output_bin(FILE *fp,struct wrecord *r,int n);
+struct wcolumn;
+char *ws_output_value(char *p,struct wcolumn *col,struct wrecord *r);
 uint16_t get_address(uint16_t base, int position);
-void strcatenc(char *out,char *text,unsigned char urlencode);
 void signal_handler(int signal);
 long diff_time(const struct timeval *tact, const struct timeval *tlast);
 
+size_t ws_urlenc(char *out, const char *in, size_t n);
+size_t ws_urldec(char *out, const char *in, size_t n);
 char* URLencode(char *str);
 char* URLdecode(char *str);
 
@@ -126,6 +276,7 @@ struct wrecord
 	float illu;
 	short humin,humout,age;
 	short uv,winddeg;
+	unsigned short err;			// WS_ERR_ bits found by ws_decode()
 	char ok;
 } w,w1;
 
@@ -135,6 +286,38 @@ struct calib
 	float illu_factor,illu_offset,uv_factor,uv_offset;
 } c = {1,0,1,0,1,0,1,0,1,0,1,0,1,0,1,0,0,1,0,1,0};
 
+// Decoder context, everything ws_decode() needs besides the raw records
+
+struct wcontext
+{	struct calib *c;
+	int altitude;
+	int read_period;
+	uint8_t entry_size;			// 0x10 WH1080, 0x14 WH3080 with illumination and UV
+};
+
+#define WS_ERR_AGE	0x0001
+#define WS_ERR_SENSOR	0x0002			// Sensor contact lost, not counted as error
+#define WS_ERR_TEMPIN	0x0004
+#define WS_ERR_TEMPOUT	0x0008
+#define WS_ERR_HUMIN	0x0010
+#define WS_ERR_HUMOUT	0x0020			// Set to 100 %, not counted as error
+#define WS_ERR_WIND	0x0040
+#define WS_ERR_GUST	0x0080
+#define WS_ERR_PRESS	0x0100
+#define WS_ERR_RAINHOUR	0x0200
+#define WS_ERR_RAINDAY	0x0400
+
+int ws_decode(struct wcontext *ctx,uint8_t *raw,int n,struct wrecord *out);
+int ws_decode_ring(struct wcontext *ctx,uint8_t *image,uint16_t address,int count,struct wrecord *out);
+int ws_errcount(unsigned short err);
+
+float c2f(float deg);
+float kmh2mph(float speed);
+float hpa2in(float press);
+float mm2in(float size);
+float kmh2ms(float speed);
+float lux2wattm2(float lux);
+
 typedef enum log_event
 {	LOG_DEBUG=1,
 	LOG_WARNING=2,
@@ -156,16 +339,267 @@ char *ws_type="WH1080";				// default to WH1080
 
 char ws_entry_size;
 int run_interval=0;			// in seconds, 0 means run once and exit, change it by -r option or RunInterval cfg
+char *run_schedule="Interval";		// Interval: read every run_interval, Aligned: also read just after the station wrote a new record
 int fhem_interval=48;
 int read_period;			// Minutes between each stored reading (set in the WS configuration)
+int dns_ttl=DEFAULT_DNS_TTL;	// seconds resolved server addresses are cached, 0 resolves on every request, change it by DNSCacheTTL cfg
 int altitude=0;				// default altitude is sea level in meter - change it by -A option or Altitude cfg
 uint16_t vendor=DEFAULT_VENDOR,product=DEFAULT_PRODUCT;
 char add_url_counter=0, alm_counter=0;
 
-usb_dev_handle *dev=NULL;
+struct wbackend ws_backend_usb={"USB",ws_usb_open,ws_usb_read,ws_usb_close};
+struct wbackend ws_backend_sim={"simulator",ws_sim_open,ws_sim_read,ws_sim_close};
+
+struct wsim ws_sim;
+struct wsession wss={&ws_backend_usb,NULL,NULL,0,0,0,0,0,0,0};
+
+// Image of the station memory, records are kept at their station addresses so get_address() can be used directly
+// The image is mapped from the shadow file if there is one, so it survives restarts of frewe-client
+
+#define WS_IMAGE_MAGIC "FREWEIMG"
+
+struct wimage
+{	uint8_t mem[WS_MAX_ENTRY_ADDR];		// 0x0000-0x00FF fixed block, 0x0100-0xFFFF history ring
+	char magic[8];
+	uint16_t curpos;			// WS_CURRENT_POSITION_ADDRESS value of the last sync
+	uint16_t count;				// Number of mirrored records ending with the record at curpos
+	uint16_t data_count;			// Data count of the last sync, a smaller one means the station was reset
+	uint8_t entry_size;
+	time_t synctime;			// Time of the last sync, the position shift can't tell a full wrap of the ring
+} ws_image, *img=&ws_image;
+
+char *shadow_file=NULL;			// Shadow file for the memory image, defaults to frewe-shadow.bin next to the cfg file
+
+// Read verify policies selectable by ReadVerify cfg, see ws_read()
+
+struct wverify
+{	char *name;
+	int (*check)(uint16_t address,uint8_t *block,uint16_t size);
+} wverify[] =
+{	{ "Double", ws_verify_double },		// Every block is read until two reads match (default)
+	{ "Plausi", ws_verify_plausi }		// Only blocks with implausible record values are read again
+}, *verify=&wverify[0];
+
+char *read_verify="Double";
+
+// Write phase of the station for RunSchedule Aligned. The station starts a new record every read_period
+// minutes of its own clock, the start is estimated from the age byte and confirmed by polling the pointer
+
+#define WS_SCHED_POLL 2			// Seconds between pointer polls around an expected write
+#define WS_SCHED_LATE 120		// Poll once a minute if no write was seen this long after the expected one
+
+struct wsched
+{	char aligned;
+	uint16_t pointer;		// WS_CURRENT_POSITION_ADDRESS seen last
+	time_t written;			// Estimated start of the record at pointer
+	char observed;			// written was seen by a poll, else it is the earliest start the age byte allows
+	time_t next;			// Next pointer poll
+} ws_sched;
+
+// Export formats of -d, data is passed in chunks of at most WS_READ_CHUNK bytes (whole records for rec)
+
+#define WS_EXPORT_BUFFER 0x10000
+
+struct wexport
+{	char *name;
+	int (*write)(FILE *fp,uint32_t address,uint8_t *data,uint32_t size);
+} wexport[] =
+{	{ "log", ws_export_log },		// 16 bytes per line through the logger (default)
+	{ "hex", ws_export_hex },		// Address and 16 hex bytes per line
+	{ "bin", ws_export_bin },		// Raw memory bytes
+	{ "rec", ws_export_rec }		// One line of raw decoded values per history record
+};
+
+// Placeholders of ws_format() templates, the error string is written instead of values failing the check
+
+#define WF_FLOAT	1		// Types
+#define WF_SHORT	2
+#define WF_TEXT		3
+#define WF_LOCAL	4		// strftime of datetime
+#define WF_UTC		5
+#define WF_ARG		6		// User, password or station type
+#define WF_TIME		7		// time_t as seconds, bulk output only
+
+#define WF_TEMP		1		// Checks
+#define WF_HUM		2
+#define WF_PRESS	3
+#define WF_NEG1		4
+
+struct wfield
+{	char code;
+	char type;
+	size_t offset;			// Value in struct wrecord
+	float (*conv)(float);		// Unit conversion
+	char *fmt;			// strftime format
+	char dec;			// Decimals of WF_FLOAT
+	char check;
+} wfield[] =
+{	{ 'h', WF_SHORT, offsetof(struct wrecord,humin), NULL, NULL, 0, WF_HUM },
+	{ 'H', WF_SHORT, offsetof(struct wrecord,humout), NULL, NULL, 0, WF_HUM },
+	{ 'I', WF_FLOAT, offsetof(struct wrecord,tempin), NULL, NULL, 1, WF_TEMP },
+	{ 'i', WF_FLOAT, offsetof(struct wrecord,tempin), c2f, NULL, 1, WF_TEMP },
+	{ 'O', WF_FLOAT, offsetof(struct wrecord,tempout), NULL, NULL, 1, WF_TEMP },
+	{ 'o', WF_FLOAT, offsetof(struct wrecord,tempout), c2f, NULL, 1, WF_TEMP },
+	{ 'E', WF_FLOAT, offsetof(struct wrecord,tempdew), NULL, NULL, 1, WF_TEMP },
+	{ 'e', WF_FLOAT, offsetof(struct wrecord,tempdew), c2f, NULL, 1, WF_TEMP },
+	{ 'C', WF_FLOAT, offsetof(struct wrecord,tempchill), NULL, NULL, 1, WF_TEMP },
+	{ 'c', WF_FLOAT, offsetof(struct wrecord,tempchill), c2f, NULL, 1, WF_TEMP },
+	{ 'W', WF_FLOAT, offsetof(struct wrecord,windspeed), NULL, NULL, 1, WF_NEG1 },
+	{ 'w', WF_FLOAT, offsetof(struct wrecord,windspeed), kmh2mph, NULL, 1, WF_NEG1 },
+	{ 'v', WF_FLOAT, offsetof(struct wrecord,windspeed), kmh2ms, NULL, 1, WF_NEG1 },
+	{ 'G', WF_FLOAT, offsetof(struct wrecord,windgust), NULL, NULL, 1, WF_NEG1 },
+	{ 'g', WF_FLOAT, offsetof(struct wrecord,windgust), kmh2mph, NULL, 1, WF_NEG1 },
+	{ 'D', WF_TEXT, offsetof(struct wrecord,winddir), NULL, NULL, 0, 0 },
+	{ 'd', WF_SHORT, offsetof(struct wrecord,winddeg), NULL, NULL, 0, WF_NEG1 },
+	{ 'P', WF_FLOAT, offsetof(struct wrecord,pressabs), NULL, NULL, 1, WF_PRESS },
+	{ 'p', WF_FLOAT, offsetof(struct wrecord,pressabs), hpa2in, NULL, 2, WF_PRESS },
+	{ 'L', WF_FLOAT, offsetof(struct wrecord,pressrel), NULL, NULL, 1, WF_PRESS },
+	{ 'l', WF_FLOAT, offsetof(struct wrecord,pressrel), hpa2in, NULL, 2, WF_PRESS },
+	{ 'm', WF_FLOAT, offsetof(struct wrecord,illu), lux2wattm2, NULL, 2, WF_NEG1 },
+	{ 'M', WF_FLOAT, offsetof(struct wrecord,illu), NULL, NULL, 1, WF_NEG1 },
+	{ 'R', WF_FLOAT, offsetof(struct wrecord,rain), NULL, NULL, 1, WF_NEG1 },
+	{ 'r', WF_FLOAT, offsetof(struct wrecord,rain), mm2in, NULL, 2, WF_NEG1 },
+	{ 'S', WF_FLOAT, offsetof(struct wrecord,rainhour), NULL, NULL, 1, WF_NEG1 },
+	{ 's', WF_FLOAT, offsetof(struct wrecord,rainhour), mm2in, NULL, 2, WF_NEG1 },
+	{ 'T', WF_FLOAT, offsetof(struct wrecord,rainday), NULL, NULL, 1, WF_NEG1 },
+	{ 't', WF_FLOAT, offsetof(struct wrecord,rainday), mm2in, NULL, 2, WF_NEG1 },
+	{ 'U', WF_SHORT, offsetof(struct wrecord,uv), NULL, NULL, 0, WF_NEG1 },
+	{ 'a', WF_SHORT, offsetof(struct wrecord,age), NULL, NULL, 0, 0 },
+	{ 'N', WF_LOCAL, 0, NULL, "%Y-%m-%d %H:%M:%S", 0, 0 },
+	{ 'n', WF_UTC, 0, NULL, "%Y-%m-%d %H:%M:%S", 0, 0 },
+	{ 'Y', WF_LOCAL, 0, NULL, "%d.%m.%Y", 0, 0 },
+	{ 'y', WF_LOCAL, 0, NULL, "%Y%m%d%H%M", 0, 0 },
+	{ 'Z', WF_LOCAL, 0, NULL, "%H:%M", 0, 0 },
+	{ 'K', WF_ARG, 0, NULL, NULL, 0, 0 },
+	{ 'x', WF_ARG, 0, NULL, NULL, 0, 0 },
+	{ 'X', WF_ARG, 0, NULL, NULL, 0, 0 }
+};
+
+// Bulk output formats of -o and BulkOutput, all records of a cycle are decoded in one batch and written
+// block buffered, one line (or binary record) per record with the columns of wcolumn[]
+
+struct woutput
+{	char *name;
+	int (*write)(FILE *fp,struct wrecord *r,int n);
+	char header;			// Write the column names at the start of the file
+} woutput[] =
+{	{ "csv", ws_output_csv, 1 },	// Comma separated values
+	{ "json", ws_output_json, 0 },	// JSON Lines, one object per record
+	{ "bin", ws_output_bin, 0 }	// Little endian record of int64 time, float32 and int16 values, winddir is left out
+}, *ws_out=NULL;
+
+char *bulk_output=NULL;			// format[:file] of the bulk output, stdout if there is no file
+FILE *ws_out_fp=NULL;
+
+struct wcolumn
+{	char *name;
+	char type;			// WF_TIME, WF_FLOAT, WF_SHORT or WF_TEXT
+	size_t offset;
+	char dec;
+} wcolumn[] =
+{	{ "time", WF_TIME, offsetof(struct wrecord,datetime), 0 },
+	{ "age", WF_SHORT, offsetof(struct wrecord,age), 0 },
+	{ "tempin", WF_FLOAT, offsetof(struct wrecord,tempin), 1 },
+	{ "humin", WF_SHORT, offsetof(struct wrecord,humin), 0 },
+	{ "tempout", WF_FLOAT, offsetof(struct wrecord,tempout), 1 },
+	{ "humout", WF_SHORT, offsetof(struct wrecord,humout), 0 },
+	{ "tempdew", WF_FLOAT, offsetof(struct wrecord,tempdew), 1 },
+	{ "tempchill", WF_FLOAT, offsetof(struct wrecord,tempchill), 1 },
+	{ "windspeed", WF_FLOAT, offsetof(struct wrecord,windspeed), 1 },
+	{ "windgust", WF_FLOAT, offsetof(struct wrecord,windgust), 1 },
+	{ "winddeg", WF_SHORT, offsetof(struct wrecord,winddeg), 0 },
+	{ "winddir", WF_TEXT, offsetof(struct wrecord,winddir), 0 },
+	{ "pressabs", WF_FLOAT, offsetof(struct wrecord,pressabs), 1 },
+	{ "pressrel", WF_FLOAT, offsetof(struct wrecord,pressrel), 1 },
+	{ "rain", WF_FLOAT, offsetof(struct wrecord,rain), 1 },
+	{ "rainhour", WF_FLOAT, offsetof(struct wrecord,rainhour), 1 },
+	{ "rainday", WF_FLOAT, offsetof(struct wrecord,rainday), 1 },
+	{ "illu", WF_FLOAT, offsetof(struct wrecord,illu), 1 },
+	{ "uv", WF_SHORT, offsetof(struct wrecord,uv), 0 },
+	{ "err", WF_SHORT, offsetof(struct wrecord,err), 0 }
+};
+
+// Rendered view of the current record w, the text of a placeholder is made on first use and then shared by
+// all templates, until ws_parse() decodes the next record and calls ws_view_reset()
+
+#define WS_VIEW_TEXT 48			// Longest plain text, "%0.1f" of FLT_MAX has 42 characters
+
+struct wvfield
+{	unsigned long serial[2];	// Record the plain and URL encoded text were made for
+	char bad;			// Value fails its check, the error string of the destination is used
+	unsigned char len[2];
+	char text[WS_VIEW_TEXT],enctext[WS_VIEW_TEXT*3];
+};
+
+struct wview
+{	unsigned long serial;		// Current record
+	unsigned long tmserial[2];
+	struct tm tm[2];		// localtime() and gmtime() of w.datetime
+	struct wvfield f[sizeof(wfield)/sizeof(wfield[0])];
+} ws_view={1};
+
+// Compiled template, a list of literal text spans and placeholders
+
+struct wop
+{	struct wfield *f;		// NULL for literal text
+	char enc;			// URL encode the value
+	int len;
+	char *text;
+};
+
+struct wprog
+{	char *format;			// Template and encoding it was compiled for
+	unsigned char urlencode;
+	int n;
+	struct wop *op;
+	char *text;			// Storage of the literal spans
+	size_t size;			// Output size estimate, literal text plus WS_FIELD_SIZE per field
+};
+
+// Growing output string, appends are amortized O(1) and a failed allocation is sticky, so a chain of
+// appends needs only one check at ws_buf_done()
+
+#define WS_FIELD_SIZE 16
+
+struct wbuf
+{	char *s;
+	size_t len,size;		// Used and allocated bytes, excluding the terminating 0
+	char failed;
+};
+
+// Time index of the positions lowpos..0, ascending. A record's time is when the station moved on to the
+// next record, this is the time of the next record minus its age. Position 0 gets the current time
+
+#define WS_INDEX_SIZE ((WS_MAX_ENTRY_ADDR-WS_MIN_ENTRY_ADDR)/0x10)	// Records of the smallest entry size
+
+struct wtimes
+{	int n;
+	int lowpos;				// Position of entry 0
+	char oldest;				// Entry 0 is the oldest record on the station
+	time_t t[WS_INDEX_SIZE];
+} ws_times;
+
+// Rain index over the time index, cumulative rain of each record. The station counts rain in 0.3 mm
+// steps with a 16 bit counter, differences are taken modulo 65536 so the counter may wrap
+
+#define WS_RAIN_JUMP 0x1000		// Larger differences are garbage or a reset of the station
+
+struct wrain
+{	struct wtimes *x;
+	double cum[WS_INDEX_SIZE];	// mm since entry 0
+} ws_rainidx;
+
+// USB read statistics
+
+struct wstats
+{	unsigned long blocks;			// Blocks delivered
+	unsigned long reads;			// Read commands sent
+	unsigned long retries;			// Failed or short reads
+	unsigned long mismatches;		// Verify reads not matching the previous read
+	unsigned long single;			// Blocks accepted after one read
+} ws_stats;
 
-//char filebuf[256];
-char *filebuf=NULL; 			// Will be allocated by html_fetcher
+char filebuf[256];				// Reply of frewe-server, http_fetcher cuts off longer replies
 
 char *frewe_server_url_submit_template   = "%s?serverkey=%s&action=addrecord&datetime=%%n&tempin=%%I&tempout=%%O&tempdew=%%E&tempchill=%%C&humin=%%h&humout=%%H&windgust=%%G&windspeed=%%W&winddir=%%D&pressabs=%%P&pressrel=%%L&rain=%%R&illu=%%M&uv=%%U&rainrate=%%S";
 char *frewe_server_url_lasttime_template = "%s?serverkey=%s&action=getlasttime";
@@ -194,6 +628,11 @@ struct wservice
 	{ "Wedaal", "Wedaal_Username", "Wedaal_StationPass", "http://www.wedaal.de/get_wetter.php?val=%x;%X;%O;%H;%L;%T;%W;%d;%Z;%Y;;;;;;;;;;;;;;;", NULL, NULL, 1, "", 0}
 };
 
+// Submissions to the services and additional URLs of a record, sent together by ws_submit_all()
+
+struct http_request ws_batch[sizeof(ws)/sizeof(ws[0])+MAX_ADD_URLS];
+int ws_batch_counter=0;
+
 char *walarm_type[] =
 {	"HighOutdoorTemp", "LowOutdoorTemp", "HighWindchillTemp", "LowWindchillTemp", "HighDewTemp", "LowDewTemp", 
 	"HighIndoorTemp", "LowIndoorTemp", "HighOutdoorHumidity", "LowOutdoorHumidity", "HighIndoorHumidity", "LowIndoorHumidity", 
@@ -221,16 +660,19 @@ int main(int argc, char **argv)
 	uint8_t help=0,dump=0, md5[16];
 	char *cp, md5str[33];
 	int position=0,startpos,endpos,curpos;		// default position is 0 (=now) - altering this by -p option can lead to read some of stored values
-	int pos60, pos0h;
+	int position_end=0;
 	int data_count;
-	int last_age;
-	int read_weather,read_fhem;
+	int last_age=0;
+	int read_weather,read_fhem,catchup;
 
-	uint16_t address,address0,address60,address0h;
+	uint16_t address=0,address0;
+	uint8_t *buffer;
+	int lowpos;
+	float rainhour,rainday;
 	long pause;
 	time_t starttime,curtime,lasttime;
 	struct timeval tact, tlast, tlastfhem;
-	struct tm *tmptr, tm;
+	struct tm *tmptr, tm, tmcur;
 	char *output;
 	
 	FILE *fd;
@@ -254,7 +696,7 @@ int main(int argc, char **argv)
 
 // Parse options
 
-	while (rv==0 && (c=getopt(argc,argv,"hH?vxf:d:a:A:p:e:t:s:c:u:r:t:k:"))!=-1)
+	while (rv==0 && (c=getopt(argc,argv,"hH?vxf:d:a:A:p:e:t:s:c:u:r:t:k:S:o:"))!=-1)
 	{
 		switch (c)
 		{
@@ -263,14 +705,33 @@ int main(int argc, char **argv)
 				logger(LOG_DEBUG,"main","USB device set to vendor=%04X product=%04X",vendor,product);
 				break;
 
+			case 'S': // simulate the station from a memory image file
+			{	char *p=strrchr(optarg,':');
+				ws_sim.speed=1;
+				if (p)
+				{	*p='\0';
+					sscanf(p+1,"%lf",&ws_sim.speed);
+				}
+				ws_sim.file=optarg;
+				wss.sim=&ws_sim;
+				wss.backend=&ws_backend_sim;
+				logger(LOG_DEBUG,"main","Simulating weather station from %s, clock factor %g",ws_sim.file,ws_sim.speed);
+				break;
+			}
+
 			case 'A': // set altitude
 				sscanf(optarg,"%d",&altitude);
 				logger(LOG_DEBUG,"main","altitude set to %d",altitude);
 				break;
 
-			case 'p': // set position
-				sscanf(optarg,"%d",&position);
-				logger(LOG_DEBUG,"main","weather station log position set to %d",position);
+			case 'p': // set position or range of positions from:to
+				if (sscanf(optarg,"%d:%d",&position,&position_end)<2) position_end=position;
+				logger(LOG_DEBUG,"main","weather station log positions set to %d..%d",position,position_end);
+				break;
+
+			case 'o': // bulk output of the records
+				logger(LOG_DEBUG,"main","Bulk output set to '%s'",optarg);
+				bulk_output=optarg;
 				break;
 
 			case 'c': // read configuration from file
@@ -329,41 +790,28 @@ int main(int argc, char **argv)
 
 			case 'd': // Dump raw data from weather station
 			{
-				uint16_t a,s,w;
+				unsigned int a,s;
+				char f[8]="log",*file=NULL,*p;
 				dump=1;
 				a=0;
 				s=0x100;
-				w=16;
-//				sscanf(optarg,"0x%hX:0x%hX",&a,&s);
-				if (sscanf(optarg,"0x%hX:0x%hX",&a,&s)<2)
-				if (sscanf(optarg,"0x%hX:%hu",&a,&s)<2)
-				if (sscanf(optarg,"%hu:0x%hX",&a,&s)<2)
-				if (sscanf(optarg,"%hu:%hu",&a,&s)<2)
-				if (sscanf(optarg,":0x%hX",&s)<1)
-					sscanf(optarg,":%hu",&s);
 
-				logger(LOG_DEBUG,"main","Dump options address=%u size=%u",a,s);
+// addr:len[:format[:file]], addr and len decimal or 0x hex
 
-				if (dev==NULL) rv=ws_open(&dev,vendor,product,0);
-
-				if (dev)
-				{
-					uint8_t *b;
-
-					logger(LOG_DEBUG,"main","Allocating %u bytes for read buffer",s);
-					b=malloc(s);
-					if (!b) 
-						logger(LOG_ERROR,"main","Could not allocate %u bytes for read buffer",s);
-					else
-					{
-						logger(LOG_DEBUG,"main","Allocated %u bytes for read buffer",s);
-						ws_read(dev,a,b,s);
-						ws_dump(a,b,s,w);
-						free(b);
-					}
+				p=strchr(optarg,':');
+				if (p)
+				{	if (p>optarg) a=strtoul(optarg,NULL,strncasecmp(optarg,"0x",2)==0?16:10);
+					if (p[1] && p[1]!=':') s=strtoul(p+1,NULL,strncasecmp(p+1,"0x",2)==0?16:10);
+					p=strchr(p+1,':');
+				}
+				if (p)
+				{	sscanf(p+1,"%7[^:]",f);
+					p=strchr(p+1,':');
+					if (p && p[1]) file=p+1;
 				}
 
-				if (dev) ws_close(&dev);
+				logger(LOG_DEBUG,"main","Dump options address=%u size=%u format=%s file=%s",a,s,f,file?file:"stdout");
+				rv=ws_export(&wss,a,s,f,file);
 				break;
 			}
 
@@ -383,11 +831,13 @@ int main(int argc, char **argv)
 				printf("Options\n");
 				printf(" -? -h            Display this help\n");
 				printf(" -a <v>:<p>       Change the vendor:product address of the usb device from the default\n");
+				printf(" -S <file>[:<f>]  Simulate the weather station from a 64 KB memory image, clock runs f times faster\n");
 				printf(" -A <alt in m>    Change altitude\n");
 				printf(" -c <filename>    Read configuration from cfg file\n");
-				printf(" -p <pos>         Alter position in weather station log from current position (can be +- value)\n");
+				printf(" -p <pos>[:<to>]  Alter position in weather station log from current position (can be +- value), or read a range\n");
+				printf(" -o <fmt>[:file]  Bulk output of all records read, fmt csv, json (JSON Lines) or bin, replaces -f output\n");
 				printf(" -v               Verbose output, enable debug and warning messages\n");
-				printf(" -d [addr]:[len]  Dump length bytes from address\n");
+				printf(" -d [addr]:[len][:fmt[:file]]  Dump length bytes from address, fmt log (default), hex, bin or rec\n");
 				printf(" -x               XML output\n");
 				printf(" -r <sec>         Run continuosly with given interval in seconds\n");
 				printf(" -s <url>         Freetz weather server URL\n");
@@ -439,14 +889,61 @@ int main(int argc, char **argv)
 	if (rv==0 && help==0 && dump==0)
 	{
 
-// Set entry size according to device type and create buffers
+// Set entry size according to device type
 
 		if(strcasecmp(ws_type,"WH3080")==0 || strcasecmp(ws_type,"WH3081")==0)
 			ws_entry_size=0x14;
 		else
 			ws_entry_size=0x10;
 
-		uint8_t buffer[ws_entry_size],buffer60[ws_entry_size],buffer0h[ws_entry_size];
+// Select the read verify policy
+
+		for (i=0;i<sizeof(wverify)/sizeof(wverify[0]);i++)
+			if (strcasecmp(read_verify,wverify[i].name)==0) verify=&wverify[i];
+		logger(LOG_DEBUG,"main","Read verify policy is %s",verify->name);
+
+// Cache the addresses of the servers, failed lookups only briefly
+
+		http_setResolverTTL(dns_ttl,dns_ttl<DEFAULT_DNS_FAIL_TTL?dns_ttl:DEFAULT_DNS_FAIL_TTL);
+
+// Select the bulk output format, the file is kept open and appended to in every cycle
+
+		if (bulk_output!=NULL && *bulk_output)
+		{	char f[8]="",*p=strchr(bulk_output,':');
+
+			sscanf(bulk_output,"%7[^:]",f);
+			for (i=0;i<sizeof(woutput)/sizeof(woutput[0]);i++)
+				if (strcasecmp(f,woutput[i].name)==0) ws_out=&woutput[i];
+			if (ws_out==NULL)
+				logger(LOG_ERROR,"main","Unknown bulk output format %s",bulk_output);
+			else if (p && p[1] && strcmp(p+1,"-")!=0)
+			{	ws_out_fp=fopen(p+1,ws_out->write==ws_output_bin?"ab":"a");
+				if (ws_out_fp==NULL)
+				{	logger(LOG_ERROR,"main","Could not open %s for bulk output",p+1);
+					ws_out=NULL;
+				}
+				else if (setvbuf(ws_out_fp,NULL,_IOFBF,WS_EXPORT_BUFFER)!=0)
+					logger(LOG_WARNING,"main","Could not set the buffer of %s",p+1);
+			}
+			else
+			{	ws_out_fp=stdout;
+				ws_stdout_buffer();
+			}
+			if (ws_out && ws_out->header)
+			{	fseek(ws_out_fp,0,SEEK_END);
+				if (ftell(ws_out_fp)<=0)
+					for (i=0;i<sizeof(wcolumn)/sizeof(wcolumn[0]);i++)
+						fprintf(ws_out_fp,"%s%c",wcolumn[i].name,i<sizeof(wcolumn)/sizeof(wcolumn[0])-1?',':'\n');
+			}
+		}
+
+// Map the memory image from the shadow file
+
+		ws_sched.aligned=strcasecmp(run_schedule,"Aligned")==0;
+		if (ws_sched.aligned) logger(LOG_DEBUG,"main","Reading aligned to the station writes");
+
+		if (shadow_file!=NULL && strcasecmp(shadow_file,"Off")!=0)
+			ws_image_open(shadow_file);
 
 // Prepare frewe-server URLs
 
@@ -497,16 +994,15 @@ int main(int argc, char **argv)
 
 // Get read period from WS
 
-		rv=ws_open(&dev,vendor,product,0);
-		if (rv==0) rv=ws_read(dev,WS_READ_PERIOD_ADDRESS,buffer,1);
+		rv=ws_read_span(&wss,0,WS_BLOCK_SIZE,img->mem);
 		if (rv==0)
-		{	read_period=buffer[0];
+		{	read_period=img->mem[WS_READ_PERIOD_ADDRESS];
 			logger(LOG_DEBUG,"main","Weather station read period is %d minutes",read_period);
 		}
-		ws_close(&dev);
 
 		if (rv!=0)
 		{	logger(LOG_ERROR,"main","Can't get read period from weather station. Stopped!");
+			ws_session_close(&wss);
 			return rv;
 		}
 
@@ -521,29 +1017,33 @@ int main(int argc, char **argv)
 // Start reading
 
 			rv=0;				// reset errors
-			startpos=endpos=position; 	// default
+			startpos=position; 		// default
+			endpos=position_end;
+			lasttime=0;
 
 // Read current time, this will be the time for record in position 0
 
 			time(&curtime);
-			tmptr=localtime(&curtime);
+			tmcur=*localtime(&curtime);	// keep a copy, ws_format() calls localtime() for every record
+			tmptr=&tmcur;
 			if (read_weather)
 				gettimeofday(&tlast, NULL);
 			if (read_fhem)
 				gettimeofday(&tlastfhem, NULL);
 			
 
-// Get the current data count (records actually saved on ws)
+// Get the current data count (records actually saved on ws) and last record address, both are in the first block
 
 			if (rv==0)
-			{	rv=ws_open(&dev,vendor,product,0);
-				if (rv==0) rv=ws_read(dev,WS_DATA_COUNT_ADDRESS,buffer,2);
+			{	rv=ws_read_span(&wss,0,WS_BLOCK_SIZE,img->mem);
 				if (rv==0)
-				{	data_count=buffer[0]+buffer[1]*256;
+				{	data_count=img->mem[WS_DATA_COUNT_ADDRESS]+img->mem[WS_DATA_COUNT_ADDRESS+1]*256;
 					if (data_count<0 || data_count>WS_TOTAL_ENTRIES) data_count=WS_TOTAL_ENTRIES;
+					address=img->mem[WS_CURRENT_POSITION_ADDRESS]+img->mem[WS_CURRENT_POSITION_ADDRESS+1]*256;
 					logger(LOG_DEBUG,"main","Data count is %d",data_count);
 				}
-				ws_close(&dev);
+				else
+					logger(LOG_ERROR,"main","Can't read data count or last position address from WS");
 			}
 
 
@@ -552,7 +1052,7 @@ int main(int argc, char **argv)
 			if (rv==0 && read_weather && frewe_server_url_lasttime!=NULL)
 			{
 				logger(LOG_DEBUG,"main","Getting lasttime from server URL: %s", frewe_server_url_lasttime);
-				rv=ws_submit(frewe_server_url_lasttime,&filebuf);
+				rv=ws_submit(frewe_server_url_lasttime,filebuf,sizeof(filebuf));
 				if (rv==0 && strlen(filebuf)>25) rv=1;				// Got some buggy output which can cause SIGSERV in strptime
 
 				if (rv==0 && strncasecmp(filebuf,"Not found",9)==0)	// If lasttime not found try to read all records from WS
@@ -575,13 +1075,15 @@ int main(int argc, char **argv)
 					}
 					if (rv==0) 
 					{	logger(LOG_DEBUG,"main","Lasttime on frewe-server is %d, time gap is %d",lasttime,curtime-lasttime);
-						startpos=floor((float)(curtime-lasttime-1)/read_period/60)*-1;  // -1 logical seconds to avoid double submittions
+						startpos=floor((float)(curtime-lasttime-1)/read_period/60)*-1;  // Estimate, set exactly from the time index
+						startpos-=1+(-startpos)/16;						// Records can be shorter than read_period
 						if (startpos<1-data_count) startpos=1-data_count;
 						endpos=0;
-						logger(LOG_WARNING,"main","Will now read entries from %d to %d",startpos,endpos);
 					}
 					else
+					{	lasttime=0;
 						rv=0;	// Ignore this error and read the current position
+					}
 				}
 				else
 				{	logger(LOG_ERROR,"main","Failed to get lasttime from %s", frewe_server_url_lasttime);
@@ -593,20 +1095,49 @@ int main(int argc, char **argv)
 
 			if (rv==0 && (startpos>0 || startpos<1-data_count || endpos >0 || endpos<1-data_count))
 				logger(LOG_INFO,"main","Position is out of available data, %d records are saved on device",data_count);
+			if (rv==0)
+			{	if (startpos<1-data_count) startpos=1-data_count;	// Only saved records are read, a range starts at the oldest one
+				if (startpos>0) startpos=0;
+				if (endpos<1-data_count) endpos=1-data_count;
+				if (endpos>0) endpos=0;
+			}
 
-// Read last record address & age
+// Sync all records needed by the positions loop (incl. 60 min and 0h records) into the image
+// The age of the last record is not known yet, age 0 gives the lowest 60 min and 0h positions
 
 			if (rv==0)
 			{
-				rv=ws_open(&dev,vendor,product,0);
-				if (rv==0) rv=ws_read(dev,WS_CURRENT_POSITION_ADDRESS,buffer,2);			
-				if (rv==0) address=buffer[0]+buffer[1]*256;
-				if (rv==0) rv=ws_read(dev,address,buffer,sizeof(buffer));
-				if (rv==0) last_age = (int) buffer[0x00];
-				if (rv!=0) logger(LOG_ERROR,"main","Can't read last position address or age from WS");
-				ws_close(&dev);
+				lowpos=startpos;
+				if (ws_pos60(startpos,0,data_count)<lowpos) lowpos=ws_pos60(startpos,0,data_count);
+				if (ws_pos0h(startpos,0,data_count,tmptr)<lowpos) lowpos=ws_pos0h(startpos,0,data_count,tmptr);
+				if (read_period>0) lowpos-=round((float)60*24/read_period);	// One more 0h window, records can be shorter than read_period
+				if (lowpos<1-data_count) lowpos=1-data_count;
+				if (lowpos>0) lowpos=0;
+
+				rv=ws_sync(&wss,address,lowpos,data_count,curtime);
+				if (rv!=0) logger(LOG_ERROR,"main","Can't read records from position %d from WS",lowpos);
+			}
+
+// Read last record age
+
+			if (rv==0)
+			{	last_age = (int) img->mem[address];
+				ws_time_build(&ws_times,address,lowpos,data_count,curtime,last_age);
+				ws_rain_build(&ws_rainidx,&ws_times,address);
+			}
+
+// Resume after the last record on frewe-server
+
+			if (rv==0 && lasttime>0)
+			{	startpos=ws_times.lowpos+ws_time_find(&ws_times,lasttime)+1;
+				logger(LOG_WARNING,"main","Will now read entries from %d to %d",startpos,endpos);
 			}
 
+// Bulk output of all records of this cycle
+
+			if (rv==0 && read_weather && ws_out!=NULL)	// Not on the FHEM only cycles, the records would be appended again
+				ws_output(ws_out,address,startpos,endpos,curtime,last_age);
+
 // Positions loop
 
 			if (rv==0)
@@ -614,45 +1145,26 @@ int main(int argc, char **argv)
     			for (curpos=startpos;curpos<=endpos;curpos++)	// NB: data errors don't break this loop
     			{
     
-    				rv=ws_open(&dev,vendor,product,0);	// rv is reset here
+    				rv=0;	// rv is reset here
     
-// Read record for the current position
+// Record for the current position
     
     				address0=get_address(address,curpos);
-    				if (rv==0) rv=ws_read(dev,address0,buffer,sizeof(buffer));
-    
-// Read record ~60 mins ago (if not existent take first available record)
-    
-    				if (rv==0)
-    				{	
-    					pos60 = curpos-round((float)(60-last_age)/read_period)-1;
-    					if (0-pos60>=data_count) pos60=1-data_count;
-   						address60=get_address(address,pos60);
-    				}
-    				if (rv==0) rv=ws_read(dev,address60,buffer60,sizeof(buffer60));
+    				buffer=img->mem+address0;
     
-// Read record from ~0h of the curpos' day (if not existent take first available record)
-// The calculation is not accurate when changing daylight saving time
+// Parse the buffer for the weather values into w, rain of the last 60 mins and since 0h is taken from the rain index
     
-    				if (rv==0)
-    				{	
-    					pos0h = 0-round((float)(tmptr->tm_hour*60+tmptr->tm_min-last_age)/read_period)-1;
-    					while (curpos<pos0h) pos0h -= round((float)60*24/read_period);
-    					if (0-pos0h>=data_count) pos0h=1-data_count;
-   						address0h=get_address(address,pos0h);
+    				rainhour=ws_rain_last(&ws_rainidx,curpos,60);
+    				rainday=ws_rain_since0h(&ws_rainidx,curpos);
+    				if (rainhour<0 || rainday<0)
+    				{	logger(LOG_ERROR,"main","Rain of position %d is not in the rain index, the record will be ignored",curpos);
+    					continue;
     				}
-    				if (rv==0) rv=ws_read(dev,address0h,buffer0h,sizeof(buffer0h));
-    
-// Close USB device anyway
-    
-    				ws_close(&dev);
-    
-// Parse the buffers for the weather values into w
-    
+
     				if (rv==0) 
-    				{	rv=ws_parse(buffer,buffer60,buffer0h,curtime,curpos,last_age);
+    				{	rv=ws_parse(buffer,rainhour,rainday,curtime,curpos,last_age);
     					if (rv==2)
-    					{	logger(LOG_ERROR,"main","ws_parse reported negative rain, position=%d, address0=0x%x, address60=0x%x, address0h=0x%x,",curpos,address0,address60,address0h);
+    					{	logger(LOG_ERROR,"main","ws_parse reported negative rain, position=%d, address0=0x%x",curpos,address0);
     						continue;
     					}
     					
@@ -664,14 +1176,8 @@ int main(int argc, char **argv)
     
 // Format and print data
     
-    				if (rv==0 && format!=NULL)
-    				{	output=malloc(strlen(format)+100);
-    					if (!output)
-    					{	logger(LOG_ERROR,"main","Could not allocate %u bytes for output",strlen(format)+100);
-    						rv=1;
-    					}
-    					else
-    					{	rv=ws_format(format,output,0,"","",errorstring);
+    				if (rv==0 && format!=NULL && ws_out==NULL)
+    				{	rv=ws_format(format,&output,0,"","",errorstring);
     						if (rv!=0)
     							logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
     						else
@@ -679,25 +1185,18 @@ int main(int argc, char **argv)
     							fflush(stdout);
     						}
     						free(output);
-    					}
     				}
 
  
 // Format and submit data to frewe-server
     
     				if (rv==0 && read_weather && frewe_server_url_submit!=NULL) 
-    				{	output=malloc(strlen(frewe_server_url_submit)+100);
-    					if (!output)
-    					{	logger(LOG_ERROR,"main","Could not allocate %u bytes for output",strlen(frewe_server_url_submit)+100);
-    						rv=1;
-    					}
-    					else
-    					{	rv=ws_format(frewe_server_url_submit,output,1,"","","");
+    				{	rv=ws_format(frewe_server_url_submit,&output,1,"","","");
     						if (rv!=0) 
     							logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
     						else
     						{	logger(LOG_DEBUG,"main","Submitting to server URL: %s", output);
-    							rv=ws_submit(output,&filebuf);
+    							rv=ws_submit(output,filebuf,sizeof(filebuf));
 
         					if (rv!=0 || strncasecmp(filebuf,"OK",2)!=0) 
         					{	logger(LOG_ERROR,"main","Error submitting to frewe-server, check FreweServerURL");
@@ -714,7 +1213,6 @@ int main(int argc, char **argv)
         				}
 
     						free(output);
-    					}
    					
     				}
 
@@ -763,37 +1261,26 @@ int main(int argc, char **argv)
       					
       				if (!ws[i].resend && curpos!=endpos) continue;		// Skip if service doesn't support data resend
       				
-    				 	l = strlen(ws[i].url)+100+strlen(ws[i].user);
-    					if (ws[i].md5==1) l+=MD5_DIGEST_LENGTH; else l+=strlen(ws[i].pass);
-    					
-    					output=malloc(l);
-    					if (!output)
-    					{	logger(LOG_ERROR,"main","Could not allocate %d bytes for output",l);
-    						rv=1;
-    					}
-    					else
-    					{
-    						if (ws[i].md5==1)
-    						{	MD5(ws[i].pass, strlen(ws[i].pass), md5);
-    							sprintf(md5str, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", md5[0],md5[1],md5[2],md5[3],md5[4],md5[5],md5[6],md5[7], md5[8],md5[9],md5[10],md5[11],md5[12],md5[13],md5[14],md5[15]);
-    						}
+    				if (ws[i].md5==1)
+    				{	MD5(ws[i].pass, strlen(ws[i].pass), md5);
+    					sprintf(md5str, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", md5[0],md5[1],md5[2],md5[3],md5[4],md5[5],md5[6],md5[7], md5[8],md5[9],md5[10],md5[11],md5[12],md5[13],md5[14],md5[15]);
+    				}
     
-    						rv=ws_format(ws[i].url,output,1,ws[i].user,ws[i].md5==1? md5str : ws[i].pass, ws[i].error);
-    						if (rv!=0) 
-    							logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
-    						else
-    						{	logger(LOG_DEBUG,"main","Submitting to server URL: %s", output);
-    							rv=ws_submit(output,&filebuf); 
-    							// NB: Error in ws_submit will be ignored, just put warning, don't stop
-    							if (rv!=0) 
-    							{	logger(LOG_WARNING,"main","Submitting to server %s failed", output);
-    								rv=0;
-    							}
-    						}
-    						free(output);
-    					}
+    				rv=ws_format(ws[i].url,&output,1,ws[i].user,ws[i].md5==1? md5str : ws[i].pass, ws[i].error);
+    				if (rv!=0) 
+    					logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
+    				else
+    				{	logger(LOG_DEBUG,"main","Submitting to server URL: %s", output);
+    					ws_submit_add(output);	// NB: Errors in ws_submit_all will be ignored, just put warning, don't stop
+    					output=NULL;
+    				}
+    				free(output);
       			}
 
+// Submit to all services at once, the last record waits for the additional URLs
+
+				if (curpos<endpos) ws_submit_all();
+
 // Save the previous record to w1
       			
       			w1=w;
@@ -808,13 +1295,7 @@ int main(int argc, char **argv)
 // Format and print data for FHEM into FHEM_file
     
   				if (rv==0 && read_fhem && FHEM_format!=NULL && FHEM_file!=NULL)
-  				{	output=malloc(strlen(FHEM_format)+100);
-  					if (!output)
-  					{	logger(LOG_ERROR,"main","Could not allocate %u bytes for FHEM output",strlen(FHEM_format)+100);
-  						rv=1;
-  					}
-  					else
-  					{	rv=ws_format(FHEM_format,output,0,"","",FHEM_errorstring);
+  				{	rv=ws_format(FHEM_format,&output,0,"","",FHEM_errorstring);
   						if (rv!=0)
   							logger(LOG_ERROR,"main","Error FHEM formatting data return code %d", rv);
   						else
@@ -828,7 +1309,6 @@ int main(int argc, char **argv)
   							}
   						}
   						free(output);
-  					}
   				}
 
     
@@ -837,47 +1317,50 @@ int main(int argc, char **argv)
     			for (i=0;i<add_url_counter && read_weather && rv==0;i++)
     			{
     				if (add_url[i]!=NULL)
-    				{	output=malloc(strlen(add_url[i])+100);
-    					if (!output)
-    					{	logger(LOG_ERROR,"main","Could not allocate %u bytes for output",strlen(add_url[i])+100);
-    						rv=1;
-    					}
-    					else
-    					{	rv=ws_format(add_url[i],output,1,"","","");
+    				{	rv=ws_format(add_url[i],&output,1,"","","");
     						if (rv!=0)
     							logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
     						else
     						{	logger(LOG_DEBUG,"main","Submitting to additional URL: %s", output);
-    							rv=ws_submit(output,&filebuf); 
-    							// NB: Error in ws_submit will be ignored, just warning
-    							if (rv!=0) 
-    							{	logger(LOG_WARNING,"main","Submitting to server %s failed", output);
-    								rv=0;
-    							}
+    							ws_submit_add(output);	// NB: Errors in ws_submit_all will be ignored, just warning
+    							output=NULL;
     						}
 					free(output);
-    					}
     				}
     			}
 			}
 
+// Submit the last record to the services and additional URLs at once
+
+			ws_submit_all();
+
+// Write the memory image back to the shadow file
+
+			ws_image_flush();
+
+			logger(LOG_DEBUG,"main","USB statistics (%s): %lu blocks, %lu reads, %lu retries, %lu mismatches, %lu single reads",
+				verify->name,ws_stats.blocks,ws_stats.reads,ws_stats.retries,ws_stats.mismatches,ws_stats.single);
+
 // Make a pause
 
 			if (run_interval>0)
 			{	
 				gettimeofday(&tact, NULL);
+				catchup=0;
+				if (ws_sched.aligned && rv==0) ws_sched_learn(address,last_age,curtime);
 				
-				while (run_interval*1000000 > diff_time(&tact, &tlast) && fhem_interval*1000000 > diff_time(&tact, &tlastfhem))
+				while (run_interval*1000000 > diff_time(&tact, &tlast) && fhem_interval*1000000 > diff_time(&tact, &tlastfhem) && !catchup)
 				{	logger(LOG_DEBUG,"main","Sleeping a second prior to the next timers check");
-					sleep(1);
+					catchup=ws_session_wait(&wss);		// Station plugged in again after a failed read
+					if (ws_sched.aligned && !catchup) catchup=ws_sched_poll(&wss);	// New record written
 					gettimeofday(&tact, NULL);
 				}
 					
 			  read_weather=read_fhem=0;
 			  
-				if (run_interval*1000000 <= diff_time(&tact, &tlast))
+				if (catchup || run_interval*1000000 <= diff_time(&tact, &tlast))
 					read_weather=1;
-			  if (fhem_interval*1000000 <= diff_time(&tact, &tlastfhem))
+			  if (catchup || fhem_interval*1000000 <= diff_time(&tact, &tlastfhem))
 			  	read_fhem=1;
 				
 			}
@@ -886,6 +1369,9 @@ int main(int argc, char **argv)
 
 	}
 
+	http_closeConnections();
+	ws_session_close(&wss);
+
 	return rv;
 }
 
@@ -901,6 +1387,7 @@ struct cfgvar
 {	{"StationType","%s",&ws_type},
 	{"Altitude","%d",&altitude},
 	{"RunInterval","%d",&run_interval},
+	{"RunSchedule","%s",&run_schedule},
 	{"TempInFactor","%f",&c.tempin_factor},
 	{"TempInOffset","%f",&c.tempin_offset},
 	{"TempOutFactor","%f",&c.tempout_factor},
@@ -931,7 +1418,11 @@ struct cfgvar
 	{"FreweServer_Key","%s",&frewe_server_key},
 	{"FreweServer_SendData","%s",&frewe_server_senddata},
 	{"FreweServer_Resend","%s",&frewe_server_resend},
-	{"Error_Email","%s",&error_email}
+	{"Error_Email","%s",&error_email},
+	{"ShadowFile","%s",&shadow_file},
+	{"ReadVerify","%s",&read_verify},
+	{"BulkOutput","%s",&bulk_output},
+	{"DNSCacheTTL","%d",&dns_ttl}
 };
 
 int read_cfg(char *fname)
@@ -1135,6 +1626,19 @@ int read_cfg(char *fname)
 	}
  
 	fclose(fp); 
+
+// Default shadow file is located next to the cfg file
+
+	if (shadow_file==NULL)
+	{	char *dir=malloc(strlen(fname)+1);
+		if (dir)
+		{	strcpy(dir,fname);
+			shadow_file=malloc(strlen(fname)+strlen("/frewe-shadow.bin")+1);
+			if (shadow_file) sprintf(shadow_file,"%s/frewe-shadow.bin",dirname(dir));
+			free(dir);
+		}
+	}
+
 	return 0;
 } 
 
@@ -1142,6 +1646,8 @@ int read_cfg(char *fname)
 // Handle USB device
 //***************************************************************
 
+#ifndef HAVE_LIBUSB1
+
 int ws_open(usb_dev_handle **dev,uint16_t vendor,uint16_t product,int reset_done)
 {
 	int rv;
@@ -1218,7 +1724,7 @@ int ws_open(usb_dev_handle **dev,uint16_t vendor,uint16_t product,int reset_done
 
 int ws_close(usb_dev_handle **dev)
 {
-	int rv;
+	int rv=0;
 
 	if (*dev)
 	{
@@ -1242,8 +1748,6 @@ int ws_read(usb_dev_handle *dev,uint16_t address,uint8_t *data,uint16_t size)
 	int rv;
 	uint8_t s,tmp[0x20],tmp2[0x20];
 
-	memset(data,0,size);
-
 	logger(LOG_DEBUG,"ws_read","Reading %d bytes from 0x%04X",size,address);
 
 	i=0;
@@ -1253,46 +1757,59 @@ int ws_read(usb_dev_handle *dev,uint16_t address,uint8_t *data,uint16_t size)
 	for (;i<size;i+=s, s=size-i<c?size-i:c)
 	{
 		uint16_t a;
-		char cmd[9],try;
+		char cmd[9],try,got;
 
 		a=address+i;
 		sprintf(cmd,"\xA1%c%c%c\xA1%c%c%c",a>>8,a,c,a>>8,a,c);
 
-		try=0;
+		try=got=0;
+		ws_stats.blocks++;
 
 		do
 		{
-        		logger(LOG_DEBUG,"ws_read","Send read command: Addr=0x%04X Size=%u",a,s);
-        		rv=usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,cmd,sizeof(cmd)-1,1000);
-        		logger(LOG_DEBUG,"ws_read","Sent %d of %d bytes",rv,sizeof(cmd)-1); 
-        		rv=usb_interrupt_read(dev,0x81,tmp,c,1000);
-        		logger(LOG_DEBUG,"ws_read","Read %d of %d bytes",rv,c); 
-        		if (rv!=c)
-        		{	if (try>3)
-        			{	if (rv<0)
-        					logger(LOG_ERROR,"ws_read","Error %d while reading from USB device",rv); 
-        				else
-        					logger(LOG_ERROR,"ws_read","Read only %d of %d bytes",rv,c); 
-        				return 1;
-        			}
-        			else
-        			{	try++;
-        				continue;
-        			}
-        		}
-        		
-        		if (try>0 && memcmp(tmp, tmp2, sizeof(tmp))==0) break;
-        		else
-        		{	memcpy(tmp2,tmp,sizeof(tmp));
-        			try++;
-        			if (try>3)
-        			{	logger(LOG_ERROR,"ws_read","Couldn't read the same %d bytes after 3 attempts",c);
-        				return 1;
-        			}
-        		}
-        		
-        	}
-        	while (1);
+			logger(LOG_DEBUG,"ws_read","Send read command: Addr=0x%04X Size=%u",a,s);
+			rv=usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,cmd,sizeof(cmd)-1,1000);
+			logger(LOG_DEBUG,"ws_read","Sent %d of %d bytes",rv,sizeof(cmd)-1); 
+			rv=usb_interrupt_read(dev,0x81,tmp,c,1000);
+			logger(LOG_DEBUG,"ws_read","Read %d of %d bytes",rv,c); 
+			ws_stats.reads++;
+			if (rv!=c)
+			{	ws_stats.retries++;
+				if (try>3)
+				{	if (rv<0)
+						logger(LOG_ERROR,"ws_read","Error %d while reading from USB device",rv); 
+					else
+						logger(LOG_ERROR,"ws_read","Read only %d of %d bytes",rv,c); 
+					memset(data+i,0,size-i);
+					return 1;
+				}
+				else
+				{	try++;
+					continue;
+				}
+			}
+
+// Let the verify policy decide if the first read needs to be confirmed by a second one
+
+			if (got==0 && !verify->check(a,tmp,c))
+			{	ws_stats.single++;
+				break;
+			}
+
+			if (got>0 && memcmp(tmp, tmp2, sizeof(tmp))==0) break;
+			else
+			{	if (got>0) ws_stats.mismatches++;
+				memcpy(tmp2,tmp,sizeof(tmp));
+				got++;
+				try++;
+				if (try>3)
+				{	logger(LOG_ERROR,"ws_read","Couldn't read the same %d bytes after 3 attempts",c);
+					memset(data+i,0,size-i);
+					return 1;
+				}
+			}
+		}
+		while (1);
 
 		memcpy(data+i,tmp,s);
 	}
@@ -1300,256 +1817,1165 @@ int ws_read(usb_dev_handle *dev,uint16_t address,uint8_t *data,uint16_t size)
 	return 0;
 }
 
-/*
-int ws_reset(usb_dev_handle *dev)
-{
-	printf("Resetting WetterStation history\n");
+#else
 
-	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\xA0\x00\x00\x20\xA0\x00\x00\x20",8,1000);
-	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\x55\x55\xAA\xFF\xFF\xFF\xFF\xFF",8,1000);
-	//_send_usb_msg("\xa0","\x00","\x00","\x20","\xa0","\x00","\x00","\x20");
-	//_send_usb_msg("\x55","\x55","\xaa","\xff","\xff","\xff","\xff","\xff");
-	usleep(28*1000);
+// libusb-1.0 implementation, the context is created on first open
 
-	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF",8,1000);
-	//_send_usb_msg("\xff","\xff","\xff","\xff","\xff","\xff","\xff","\xff");
-	usleep(28*1000);
+libusb_context *ws_usb_ctx=NULL;
 
-	//_send_usb_msg("\x05","\x20","\x01","\x38","\x11","\x00","\x00","\x00");
-	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\x05\x20\x01\x38\x11\x00\x00\x00",8,1000);
-	usleep(28*1000);
+int ws_open(usb_dev_handle **dev,uint16_t vendor,uint16_t product,int reset_done)
+{
+	int rv=0;
 
-	//_send_usb_msg("\x00","\x00","\xaa","\x00","\x00","\x00","\x20","\x3e");
-	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\x00\x00\xAA\x00\x00\x00\x20\x3E",8,1000);
-	usleep(28*1000);
+	*dev=NULL;
 
-	return 0;
-}
-*/
+	if (ws_usb_ctx==NULL)
+	{	logger(LOG_DEBUG,"ws_open","Initialise libusb");
+		rv=libusb_init(&ws_usb_ctx);
+		if (rv!=0)
+		{	logger(LOG_ERROR,"ws_open","Error initialising libusb return code %d",rv);
+			ws_usb_ctx=NULL;
+			return 1;
+		}
+	}
 
-//***************************************************************
-// Parse, format and submit weather values
-//***************************************************************
+	logger(LOG_DEBUG,"ws_open","Scan for device %04X:%04X",vendor,product);
+	*dev=libusb_open_device_with_vid_pid(ws_usb_ctx,vendor,product);
 
-// Unit conversion functions
+	if (*dev)
+	{
+		if (libusb_kernel_driver_active(*dev,0)==1)
+		{	logger(LOG_WARNING,"ws_open","Interface 0 already claimed by kernel driver, attempting to detach it");
+			rv=libusb_detach_kernel_driver(*dev,0);
+			if (rv!=0) logger(LOG_ERROR,"ws_open","Error detaching kernel driver return code %d", rv);
+		}
 
-float c2f(float deg)
-{ return 1.8*deg+32;
-}
+		if (rv==0)
+		{	rv=libusb_claim_interface(*dev,0);
+			if (rv!=0) logger(LOG_ERROR,"ws_open","Error claiming device return code %d", rv);
+		}
 
-float kmh2mph(float speed)
-{ return speed*0.621371192;
-}
+		if (rv==0)
+		{	rv=libusb_set_interface_alt_setting(*dev,0,0);	// Sometimes a timeout occures here, although the device is attached
+			if (rv==LIBUSB_ERROR_TIMEOUT && !reset_done)
+			{	logger(LOG_ERROR,"ws_open","Error setting alt interface return code %d, trying to reset the USB device", rv);
+				rv=libusb_reset_device(*dev);
+				if (rv!=0 && rv!=LIBUSB_ERROR_NOT_FOUND)
+					logger(LOG_ERROR,"ws_open","Error resetting USB device return code %d", rv);
+				else
+				{	libusb_close(*dev);		// Close, re-enumerate and reopen the USB device after reset
+					return ws_open(dev,vendor,product,1);
+				}
+			}
+			else if (rv!=0) logger(LOG_ERROR,"ws_open","Error setting alt interface return code %d", rv);
+		}
+	}
+	else
+	{
+		logger(LOG_ERROR,"ws_open","Device %04X:%04X not found",vendor,product);
+		rv=1;
+	}
 
-float kmh2ms(float speed)
-{ return speed / 3.6;
-}
+	if (rv==0) logger(LOG_DEBUG,"ws_open","Device %04X:%04X opened",vendor,product);
 
-float hpa2in(float press)
-{ return press*0.0295300586467;
+	return rv;
 }
 
-float mm2in(float size)
-{ return size*0.0393700787;
-}
+int ws_close(usb_dev_handle **dev)
+{
+	int rv=0;
 
-// There is no single conversion factor between lx and W/m2; there is a different conversion factor for every wavelength
-// and it is not possible to make a conversion unless one knows the spectral composition of the light.
+	if (*dev)
+	{
+		rv=libusb_release_interface(*dev, 0);
+		if (rv!=0) logger(LOG_ERROR,"ws_close","Could not release interface, return code %d", rv);
 
-float lux2wattm2(float lux)
-{ return lux*1.4641/1000;
+		libusb_close(*dev);
+		*dev=NULL;
+	}
+
+	if (rv==0) logger(LOG_DEBUG,"ws_close","USB device released and closed");
+
+	return rv;
 }
 
-// Parse memory buffer and fill the wrecord static structure w with all weather values
+// USB hotplug, only flags are set here, the device is closed and reopened outside of the callback
 
-int ws_parse(uint8_t *buffer, uint8_t *buffer60, uint8_t *buffer0h, time_t curtime, int position, int last_age)
+int ws_hotplug(libusb_context *ctx,libusb_device *device,libusb_hotplug_event event,void *user_data)
 {
-	char *dir[]=
-	{
-		"N","NNE","NE","ENE","E","ESE","SE","SSE",
+	struct wsession *s=user_data;
+
+	if (event==LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+	{	logger(LOG_DEBUG,"ws_hotplug","Device %04X:%04X arrived",vendor,product);
+		s->gone=0;
+		s->arrived=1;
+	}
+	else if (event==LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+	{	logger(LOG_DEBUG,"ws_hotplug","Device %04X:%04X left",vendor,product);
+		s->gone=1;
+		s->arrived=0;
+	}
+
+	return 0;
+}
+
+void ws_hotplug_init(struct wsession *s)
+{
+	libusb_hotplug_callback_handle h;
+
+	s->hotplug=-1;		// Try once only
+
+	if (ws_usb_ctx==NULL && libusb_init(&ws_usb_ctx)!=0)
+	{	ws_usb_ctx=NULL;
+		return;
+	}
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{	logger(LOG_DEBUG,"ws_hotplug_init","USB hotplug is not supported");
+		return;
+	}
+
+	if (libusb_hotplug_register_callback(ws_usb_ctx,LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED|LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_NO_FLAGS,vendor,product,LIBUSB_HOTPLUG_MATCH_ANY,ws_hotplug,s,&h)!=0)
+	{	logger(LOG_WARNING,"ws_hotplug_init","Could not register USB hotplug callback");
+		return;
+	}
+
+	logger(LOG_DEBUG,"ws_hotplug_init","USB hotplug callback registered for %04X:%04X",vendor,product);
+	s->hotplug=1;
+}
+
+// Asynchronous transfer queue. The station answers one read command at a time, so the commands
+// are sent one after another, but the interrupt reads for the next WS_QUEUE_DEPTH blocks are armed
+// in advance. The next command goes out from the event loop once both the previous command and
+// its answer are completed, whichever of the two callbacks comes last
+
+#define WQ_PENDING	0
+#define WQ_DONE		1
+#define WQ_FAILED	2
+
+struct wqueue;
+
+struct wslot
+{	struct libusb_transfer *t;
+	struct wqueue *q;
+	int block;
+	char busy;
+	uint8_t buf[WS_BLOCK_SIZE];
+};
+
+struct wqueue
+{	usb_dev_handle *dev;
+	int n;					// Blocks in the queue
+	uint16_t *addr;				// Address of each block
+	uint8_t *data;				// Answer of each block, n*WS_BLOCK_SIZE bytes
+	char *state;				// WQ_PENDING, WQ_DONE or WQ_FAILED
+	int cmd;				// Next block to send the read command for
+	int arm;				// Next block to arm the interrupt read for
+	int done;				// Blocks answered
+	int active;				// Submitted transfers
+	char progress,stop;
+	struct libusb_transfer *ct;		// Read command, only one is on the way
+	char ct_busy;
+	uint8_t ct_buf[LIBUSB_CONTROL_SETUP_SIZE+8];
+	struct wslot slot[WS_QUEUE_DEPTH];
+};
+
+void ws_queue_stop(struct wqueue *q)
+{
+	int i;
+
+	q->stop=1;
+	if (q->ct_busy) libusb_cancel_transfer(q->ct);
+	for (i=0;i<WS_QUEUE_DEPTH;i++)
+		if (q->slot[i].busy) libusb_cancel_transfer(q->slot[i].t);
+}
+
+int ws_queue_send(struct wqueue *q);
+
+// Send the next command if the control transfer is free and every command sent so far is answered
+
+void ws_queue_next(struct wqueue *q)
+{
+	if (!q->stop && !q->ct_busy && q->cmd<q->n && q->done==q->cmd && ws_queue_send(q)!=0)
+		ws_queue_stop(q);
+}
+
+void ws_queue_cmd_done(struct libusb_transfer *t)
+{
+	struct wqueue *q=t->user_data;
+
+	q->ct_busy=0;
+	q->active--;
+	q->progress=1;
+
+	if (q->stop) return;
+
+	if (t->status!=LIBUSB_TRANSFER_COMPLETED)
+	{	logger(LOG_DEBUG,"ws_queue_cmd_done","Read command failed with status %d",t->status);
+		ws_queue_stop(q);
+		return;
+	}
+
+	ws_queue_next(q);
+}
+
+int ws_queue_send(struct wqueue *q)
+{
+	uint16_t a=q->addr[q->cmd];
+	uint8_t *cmd=q->ct_buf+LIBUSB_CONTROL_SETUP_SIZE;
+
+	cmd[0]=0xA1; cmd[1]=a>>8; cmd[2]=a; cmd[3]=WS_BLOCK_SIZE;
+	cmd[4]=0xA1; cmd[5]=a>>8; cmd[6]=a; cmd[7]=WS_BLOCK_SIZE;
+	libusb_fill_control_setup(q->ct_buf,LIBUSB_REQUEST_TYPE_CLASS+LIBUSB_RECIPIENT_INTERFACE,9,0x200,0,8);
+	libusb_fill_control_transfer(q->ct,q->dev,q->ct_buf,ws_queue_cmd_done,q,1000);
+
+	logger(LOG_DEBUG,"ws_queue_send","Send read command: Addr=0x%04X",a);
+	if (libusb_submit_transfer(q->ct)!=0) return 1;
+	q->ct_busy=1;
+	q->active++;
+	q->cmd++;
+	return 0;
+}
+
+void ws_queue_read_done(struct libusb_transfer *t);
+
+int ws_queue_arm(struct wqueue *q,struct wslot *sl)
+{
+	sl->block=q->arm;
+	libusb_fill_interrupt_transfer(sl->t,q->dev,0x81,sl->buf,WS_BLOCK_SIZE,ws_queue_read_done,sl,0);
+	if (libusb_submit_transfer(sl->t)!=0) return 1;
+	sl->busy=1;
+	q->active++;
+	q->arm++;
+	return 0;
+}
+
+void ws_queue_read_done(struct libusb_transfer *t)
+{
+	struct wslot *sl=t->user_data;
+	struct wqueue *q=sl->q;
+
+	sl->busy=0;
+	q->active--;
+	q->progress=1;
+
+	if (q->stop) return;
+
+	if (t->status==LIBUSB_TRANSFER_COMPLETED && t->actual_length==WS_BLOCK_SIZE)
+	{	memcpy(q->data+sl->block*WS_BLOCK_SIZE,sl->buf,WS_BLOCK_SIZE);
+		q->state[sl->block]=WQ_DONE;
+		q->done++;
+	}
+	else
+	{	logger(LOG_DEBUG,"ws_queue_read_done","Read of 0x%04X failed with status %d, %d bytes",q->addr[sl->block],t->status,t->actual_length);
+		q->state[sl->block]=WQ_FAILED;
+		ws_queue_stop(q);		// Answers may be out of order now, requeue the rest
+		return;
+	}
+
+	if (q->arm<q->n && ws_queue_arm(q,sl)!=0)
+	{	ws_queue_stop(q);
+		return;
+	}
+
+	ws_queue_next(q);
+}
+
+// Read n blocks at addr[] once into data, set state[] of every block
+
+int ws_queue_run(usb_dev_handle *dev,int n,uint16_t *addr,uint8_t *data,char *state)
+{
+	struct wqueue q;
+	struct timeval tv;
+	int i;
+
+	memset(&q,0,sizeof(q));
+	q.dev=dev;
+	q.n=n;
+	q.addr=addr;
+	q.data=data;
+	q.state=state;
+	memset(state,WQ_PENDING,n);
+
+	q.ct=libusb_alloc_transfer(0);
+	for (i=0;i<WS_QUEUE_DEPTH;i++)
+	{	q.slot[i].t=libusb_alloc_transfer(0);
+		q.slot[i].q=&q;
+	}
+
+	for (i=0;i<WS_QUEUE_DEPTH && q.arm<n && !q.stop;i++)
+		if (q.slot[i].t==NULL || ws_queue_arm(&q,&q.slot[i])!=0) ws_queue_stop(&q);
+	if (q.ct==NULL) ws_queue_stop(&q);
+	ws_queue_next(&q);
+
+// Event loop, a second without any completion stops the queue (like the 1000 ms timeout of the synchronous reads)
+
+	while (q.active>0)
+	{	q.progress=0;
+		tv.tv_sec=1;
+		tv.tv_usec=0;
+		libusb_handle_events_timeout_completed(ws_usb_ctx,&tv,NULL);
+		if (!q.progress && !q.stop)
+		{	logger(LOG_DEBUG,"ws_queue_run","No answer from USB device, stopping the queue");
+			ws_queue_stop(&q);
+		}
+	}
+
+	for (i=0;i<n;i++)
+		if (state[i]==WQ_PENDING) state[i]=WQ_FAILED;
+
+	if (q.ct) libusb_free_transfer(q.ct);
+	for (i=0;i<WS_QUEUE_DEPTH;i++)
+		if (q.slot[i].t) libusb_free_transfer(q.slot[i].t);
+
+	return 0;
+}
+
+// Read size bytes from address: all blocks are queued at once, blocks which failed or need to be
+// confirmed by the verify policy are queued again until two reads match, like the synchronous version
+
+int ws_read(usb_dev_handle *dev,uint16_t address,uint8_t *data,uint16_t size)
+{
+	int i,j,n,m,rv=0;
+	uint16_t *addr,*qaddr;
+	uint8_t *prev,*qdata;
+	char *tries,*got,*state,*ok;
+	int *qidx;
+
+	logger(LOG_DEBUG,"ws_read","Reading %d bytes from 0x%04X",size,address);
+
+	n=(size+WS_BLOCK_SIZE-1)/WS_BLOCK_SIZE;
+	addr=malloc(n*sizeof(uint16_t)*2);
+	prev=malloc(n*WS_BLOCK_SIZE*2);
+	tries=malloc(n*4);
+	qidx=malloc(n*sizeof(int));
+	if (!addr || !prev || !tries || !qidx)
+	{	logger(LOG_ERROR,"ws_read","Could not allocate read queue for %d blocks",n);
+		free(addr); free(prev); free(tries); free(qidx);
+		return 1;
+	}
+	qaddr=addr+n;
+	qdata=prev+n*WS_BLOCK_SIZE;
+	got=tries+n;
+	state=got+n;
+	ok=state+n;		// Block accepted
+
+	for (i=0;i<n;i++)
+	{	addr[i]=address+i*WS_BLOCK_SIZE;
+		tries[i]=got[i]=ok[i]=0;
+	}
+
+	while (rv==0)
+	{
+		for (i=m=0;i<n;i++)
+			if (!ok[i])
+			{	qidx[m]=i;
+				qaddr[m++]=addr[i];
+			}
+		if (m==0) break;
+
+		ws_queue_run(dev,m,qaddr,qdata,state);
+
+		for (j=0;j<m && rv==0;j++)
+		{	uint8_t *b=qdata+j*WS_BLOCK_SIZE, *p;
+
+			i=qidx[j];
+			p=prev+i*WS_BLOCK_SIZE;
+			ws_stats.reads++;
+
+			if (state[j]!=WQ_DONE)
+			{	ws_stats.retries++;
+				if (++tries[i]>4)
+				{	logger(LOG_ERROR,"ws_read","Error while reading 0x%04X from USB device",addr[i]);
+					rv=1;
+				}
+				continue;
+			}
+
+			if (got[i]==0 && !verify->check(addr[i],b,WS_BLOCK_SIZE))
+			{	ws_stats.single++;
+				memcpy(p,b,WS_BLOCK_SIZE);
+				ok[i]=1;
+			}
+			else if (got[i]>0 && memcmp(p,b,WS_BLOCK_SIZE)==0)
+				ok[i]=1;
+			else
+			{	if (got[i]>0) ws_stats.mismatches++;
+				memcpy(p,b,WS_BLOCK_SIZE);
+				got[i]++;
+				if (++tries[i]>3)
+				{	logger(LOG_ERROR,"ws_read","Couldn't read the same %d bytes after 3 attempts",WS_BLOCK_SIZE);
+					rv=1;
+				}
+			}
+
+			if (ok[i]) ws_stats.blocks++;
+		}
+	}
+
+	for (i=0;i<n;i++)
+	{	int s=size-i*WS_BLOCK_SIZE<WS_BLOCK_SIZE?size-i*WS_BLOCK_SIZE:WS_BLOCK_SIZE;
+		if (ok[i])
+			memcpy(data+i*WS_BLOCK_SIZE,prev+i*WS_BLOCK_SIZE,s);
+		else
+			memset(data+i*WS_BLOCK_SIZE,0,s);
+	}
+
+	free(addr); free(prev); free(tries); free(qidx);
+	return rv;
+}
+
+#endif
+
+// Read verify policies, return 1 if a block must be read again to confirm its content
+// The WH1080 returns garbage sometimes, so blocks of the fixed area are always confirmed
+
+int ws_verify_double(uint16_t address,uint8_t *block,uint16_t size)
+{
+	return 1;
+}
+
+// Verify only blocks containing an implausible record (or a part of it)
+
+int ws_verify_plausi(uint16_t address,uint8_t *block,uint16_t size)
+{
+	int r,from,to;
+
+	if (address<WS_MIN_ENTRY_ADDR || ws_entry_size==0) return 1;
+
+	r=address-(address-WS_MIN_ENTRY_ADDR)%ws_entry_size;	// First record touching the block
+	for (;r<address+size;r+=ws_entry_size)
+	{	from=r<address?address-r:0;
+		to=r+ws_entry_size>address+size?address+size-r:ws_entry_size;
+		if (!ws_plausible(block+r-address,from,to)) return 1;
+	}
+
+	return 0;
+}
+
+// Check the raw record bytes rec[from..to) for plausibility, bytes outside are not known
+// NB: rec points to the record start and may be outside the block for from>0
+
+int ws_plausible(uint8_t *rec,int from,int to)
+{
+	int sensorlost=-1;
+
+	if (from<=0x0F && 0x0F<to) sensorlost=(rec[0x0F] & 64)!=0;
+
+	if (from<=0x00 && 0x00<to && read_period>0 && rec[0x00]>read_period+1) return 0;		// Age
+	if (from<=0x01 && 0x01<to && (rec[0x01]==0 || rec[0x01]>100)) return 0;			// Inside humidity
+	if (from<=0x02 && 0x03<to && rec[0x02]+((rec[0x03]&0x7F)<<8)>1000) return 0;		// Inside temperature
+	if (from<=0x07 && 0x08<to && (rec[0x07]+(rec[0x08]<<8)<7000 || rec[0x07]+(rec[0x08]<<8)>12000)) return 0;	// Pressure
+
+	if (sensorlost==0)
+	{	if (from<=0x04 && 0x04<to && (rec[0x04]==0 || rec[0x04]>100)) return 0;		// Outside humidity
+		if (from<=0x05 && 0x06<to && rec[0x05]+((rec[0x06]&0x7F)<<8)>1000) return 0;	// Outside temperature
+	}
+
+	return 1;
+}
+
+// Read from the session device, open it on first use. If a transfer fails the device
+// is closed and reopened once (ws_open handles the -62 reset) before giving up
+
+int ws_session_read(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size)
+{
+	int rv;
+
+	if (!s->isopen)
+	{	rv=s->backend->open(s);
+		if (rv!=0)
+		{	s->backend->close(s);
+			s->catchup=1;
+			return rv;
+		}
+		s->isopen=1;
+		s->opens++;
+	}
+
+	rv=s->backend->read(s,address,data,size);
+
+	if (rv!=0)
+	{	logger(LOG_WARNING,"ws_session_read","Reading 0x%04X failed, reconnecting %s device",address,s->backend->name);
+		s->backend->close(s);
+		s->isopen=0;
+		rv=s->backend->open(s);
+		if (rv==0)
+		{	s->isopen=1;
+			s->reconnects++;
+			rv=s->backend->read(s,address,data,size);
+		}
+		if (rv!=0)
+		{	s->backend->close(s);
+			s->isopen=0;
+		}
+	}
+
+	s->catchup=rv!=0;
+	return rv;
+}
+
+// Wait a second. With libusb-1.0 hotplug events are handled meanwhile, returns 1 if the station
+// arrived again after a failed read, so the caller can catch up at once instead of waiting a whole interval
+
+int ws_session_wait(struct wsession *s)
+{
+#ifdef HAVE_LIBUSB1
+	if (s->hotplug==1)
+	{	struct timeval tv={1,0};
+
+		libusb_handle_events_timeout_completed(ws_usb_ctx,&tv,NULL);
+		if (s->gone && s->isopen)
+		{	s->backend->close(s);
+			s->isopen=0;
+		}
+		if (s->arrived)
+		{	s->arrived=0;
+			if (s->catchup)
+			{	logger(LOG_INFO,"ws_session_wait","Device %04X:%04X is back, reading missed data now",vendor,product);
+				return 1;
+			}
+		}
+		return 0;
+	}
+#endif
+	sleep(1);
+	return 0;
+}
+
+void ws_session_close(struct wsession *s)
+{
+	if (s->isopen)
+	{	logger(LOG_DEBUG,"ws_session_close","Closing %s session after %d opens and %d reconnects",s->backend->name,s->opens,s->reconnects);
+		s->backend->close(s);
+		s->isopen=0;
+	}
+}
+
+// USB backend
+
+int ws_usb_open(struct wsession *s)
+{
+#ifdef HAVE_LIBUSB1
+	if (!s->hotplug) ws_hotplug_init(s);
+
+	if (s->gone)
+	{	logger(LOG_WARNING,"ws_usb_open","Device %04X:%04X is unplugged, reading is suspended",vendor,product);
+		return 1;
+	}
+#endif
+	return ws_open(&s->dev,vendor,product,0);
+}
+
+int ws_usb_read(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size)
+{
+	return ws_read(s->dev,address,data,size);
+}
+
+void ws_usb_close(struct wsession *s)
+{
+	ws_close(&s->dev);
+}
+
+// Simulator backend, the image is loaded once and keeps running across reconnects
+
+int ws_sim_open(struct wsession *s)
+{
+	struct wsim *m=s->sim;
+	FILE *fp;
+	size_t l;
+
+	if (m->start) return 0;
+
+	fp=fopen(m->file,"rb");
+	if (fp==NULL)
+	{	logger(LOG_ERROR,"ws_sim_open","Could not open memory image %s",m->file);
+		return 1;
+	}
+	memset(m->mem,0,sizeof(m->mem));
+	l=fread(m->mem,1,sizeof(m->mem),fp);
+	fclose(fp);
+
+	m->age0=m->mem[m->mem[WS_CURRENT_POSITION_ADDRESS]+m->mem[WS_CURRENT_POSITION_ADDRESS+1]*256];
+	m->written=0;
+	time(&m->start);
+
+	logger(LOG_INFO,"ws_sim_open","Simulating weather station from %s (%u bytes), clock factor %g",m->file,(unsigned)l,m->speed);
+	return 0;
+}
+
+int ws_sim_read(struct wsession *s,uint16_t address,uint8_t *data,uint16_t size)
+{
+	uint32_t l=size;
+
+	ws_sim_advance(s->sim);
+
+	if (address+l>WS_MAX_ENTRY_ADDR) l=WS_MAX_ENTRY_ADDR-address;
+	memcpy(data,s->sim->mem+address,l);
+	if (l<size) memcpy(data+l,s->sim->mem,size-l);
+
+	ws_stats.reads+=(size+WS_BLOCK_SIZE-1)/WS_BLOCK_SIZE;
+	ws_stats.blocks+=(size+WS_BLOCK_SIZE-1)/WS_BLOCK_SIZE;
+	return 0;
+}
+
+void ws_sim_close(struct wsession *s)
+{
+}
+
+// Write the records due on the simulated clock and update the age of the current record
+
+void ws_sim_advance(struct wsim *m)
+{
+	int rp=m->mem[WS_READ_PERIOD_ADDRESS],n,dc;
+	uint16_t cur,next;
+	double t;
+
+	if (rp==0 || ws_entry_size==0) return;
+
+	t=difftime(time(NULL),m->start)*m->speed+m->age0*60;		// Simulated seconds since the current record of the file was started
+	n=t/(rp*60);
+
+	cur=m->mem[WS_CURRENT_POSITION_ADDRESS]+m->mem[WS_CURRENT_POSITION_ADDRESS+1]*256;
+	for (;m->written<n;m->written++)
+	{	next=cur+ws_entry_size;
+		if (next<WS_MIN_ENTRY_ADDR || (uint32_t)cur+ws_entry_size>=WS_MAX_ENTRY_ADDR) next=WS_MIN_ENTRY_ADDR;
+
+		m->mem[cur]=rp;						// Age of a completed record is the read period
+		memcpy(m->mem+next,m->mem+cur,ws_entry_size);		// Sensor values are kept
+		m->mem[next]=0;
+		cur=next;
+
+		dc=m->mem[WS_DATA_COUNT_ADDRESS]+m->mem[WS_DATA_COUNT_ADDRESS+1]*256;
+		if (dc<WS_TOTAL_ENTRIES) dc++;
+		m->mem[WS_DATA_COUNT_ADDRESS]=dc&0xFF;
+		m->mem[WS_DATA_COUNT_ADDRESS+1]=dc>>8;
+	}
+	m->mem[WS_CURRENT_POSITION_ADDRESS]=cur&0xFF;
+	m->mem[WS_CURRENT_POSITION_ADDRESS+1]=cur>>8;
+
+	m->mem[cur]=(t-n*rp*60)/60;
+}
+
+// Read station memory [from,to) into image at the same offsets, in aligned 32 byte blocks
+
+int ws_read_span(struct wsession *s,uint32_t from,uint32_t to,uint8_t *image)
+{
+	uint32_t a,l;
+	int rv=0;
+
+	from&=~(WS_BLOCK_SIZE-1);
+	to=(to+WS_BLOCK_SIZE-1)&~(WS_BLOCK_SIZE-1);
+	if (to>WS_MAX_ENTRY_ADDR) to=WS_MAX_ENTRY_ADDR;
+
+	logger(LOG_DEBUG,"ws_read_span","Reading 0x%04X-0x%04X",from,to);
+
+	for (a=from;a<to && rv==0;a+=l)
+	{	l=to-a<WS_READ_CHUNK?to-a:WS_READ_CHUNK;
+		rv=ws_session_read(s,a,image+a,l);
+	}
+
+	return rv;
+}
+
+// Read count records of the history ring beginning at address, wrap from the ring end to WS_MIN_ENTRY_ADDR
+// NB: 0xFF00 is a multiple of both entry sizes, so a record never crosses the ring end
+
+int ws_read_ring(struct wsession *s,uint16_t address,int count,uint8_t *image)
+{
+	uint32_t to;
+	int rv;
+
+	if (count>WS_TOTAL_ENTRIES) count=WS_TOTAL_ENTRIES;
+	if (count<=0) return 0;
+
+	to=address+count*ws_entry_size;
+	if (to<=WS_MAX_ENTRY_ADDR)
+		return ws_read_span(s,address,to,image);
+
+	rv=ws_read_span(s,address,WS_MAX_ENTRY_ADDR,image);
+	if (rv==0) rv=ws_read_span(s,WS_MIN_ENTRY_ADDR,to-WS_MAX_ENTRY_ADDR+WS_MIN_ENTRY_ADDR,image);
+	return rv;
+}
+
+// Bring the image up to date for positions lowpos..0 relative to the current record at address.
+// Mirrored records are not read again, only the ones written since the last sync (incl. the record
+// current at that time, the station kept updating it) and older ones which are not mirrored yet.
+// If more time has passed than the ring covers at read_period, the station may have written it all
+// around, the image is read again completely
+
+int ws_sync(struct wsession *s,uint16_t address,int lowpos,int data_count,time_t curtime)
+{
+	int shift,vlow=1,vhigh=0,rv=0;	// vlow..vhigh are the positions still valid in the image
+
+	if (lowpos<1-WS_TOTAL_ENTRIES) lowpos=1-WS_TOTAL_ENTRIES;
+
+	if (img->count>0 && read_period>0 && (img->synctime>curtime || curtime-img->synctime>=(time_t)WS_TOTAL_ENTRIES*read_period*60))
+	{	logger(LOG_INFO,"ws_sync","Last sync %d minutes ago, the station may have overwritten the whole ring",(int)(curtime-img->synctime)/60);
+		img->count=0;
+	}
+
+	if (img->count>0 && img->entry_size==ws_entry_size && data_count>=img->data_count)
+	{	shift=((address+WS_MAX_ENTRY_ADDR-WS_MIN_ENTRY_ADDR-img->curpos)%(WS_MAX_ENTRY_ADDR-WS_MIN_ENTRY_ADDR))/ws_entry_size;
+		vhigh=-shift-1;
+		vlow=-shift-img->count+1;
+		if (vlow<1-WS_TOTAL_ENTRIES) vlow=1-WS_TOTAL_ENTRIES;	// Overwritten by the station meanwhile
+	}
+
+	if (vlow>vhigh)
+	{	logger(LOG_DEBUG,"ws_sync","No valid records in image, reading positions %d to 0",lowpos);
+		rv=ws_read_ring(s,get_address(address,lowpos),1-lowpos,img->mem);
+		vlow=lowpos;
+	}
+	else
+	{	logger(LOG_DEBUG,"ws_sync","Image holds positions %d to %d, reading %d new records",vlow,vhigh,-vhigh);
+		rv=ws_read_ring(s,get_address(address,vhigh+1),-vhigh,img->mem);
+		if (rv==0 && lowpos<vlow)
+		{	logger(LOG_DEBUG,"ws_sync","Reading older positions %d to %d",lowpos,vlow-1);
+			rv=ws_read_ring(s,get_address(address,lowpos),vlow-lowpos,img->mem);
+			vlow=lowpos;
+		}
+	}
+
+	if (rv==0)
+	{	img->curpos=address;
+		img->count=1-vlow;
+		img->data_count=data_count;
+		img->entry_size=ws_entry_size;
+		img->synctime=curtime;
+	}
+
+	return rv;
+}
+
+// Map the memory image from the shadow file, create it if needed. Keep the static image on errors
+
+int ws_image_open(char *fname)
+{
+	int fd;
+	struct wimage *m;
+
+	fd=open(fname,O_RDWR|O_CREAT,0644);
+	if (fd<0)
+	{	logger(LOG_WARNING,"ws_image_open","Could not open shadow file %s",fname);
+		return 1;
+	}
+
+	if (ftruncate(fd,sizeof(struct wimage))!=0)
+	{	logger(LOG_WARNING,"ws_image_open","Could not resize shadow file %s",fname);
+		close(fd);
+		return 1;
+	}
+
+	m=mmap(NULL,sizeof(struct wimage),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (m==MAP_FAILED)
+	{	logger(LOG_WARNING,"ws_image_open","Could not map shadow file %s",fname);
+		return 1;
+	}
+
+	if (memcmp(m->magic,WS_IMAGE_MAGIC,sizeof(m->magic))!=0)
+	{	logger(LOG_INFO,"ws_image_open","Initialising shadow file %s",fname);
+		memset(m,0,sizeof(struct wimage));
+		memcpy(m->magic,WS_IMAGE_MAGIC,sizeof(m->magic));
+	}
+	else
+		logger(LOG_DEBUG,"ws_image_open","Shadow file %s holds %d records up to 0x%04X",fname,m->count,m->curpos);
+
+	img=m;
+	return 0;
+}
+
+void ws_image_flush(void)
+{
+	if (img!=&ws_image && msync(img,sizeof(struct wimage),MS_SYNC)!=0)
+		logger(LOG_WARNING,"ws_image_flush","Could not write back shadow file");
+}
+
+/*
+int ws_reset(usb_dev_handle *dev)
+{
+	printf("Resetting WetterStation history\n");
+
+	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\xA0\x00\x00\x20\xA0\x00\x00\x20",8,1000);
+	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\x55\x55\xAA\xFF\xFF\xFF\xFF\xFF",8,1000);
+	//_send_usb_msg("\xa0","\x00","\x00","\x20","\xa0","\x00","\x00","\x20");
+	//_send_usb_msg("\x55","\x55","\xaa","\xff","\xff","\xff","\xff","\xff");
+	usleep(28*1000);
+
+	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF",8,1000);
+	//_send_usb_msg("\xff","\xff","\xff","\xff","\xff","\xff","\xff","\xff");
+	usleep(28*1000);
+
+	//_send_usb_msg("\x05","\x20","\x01","\x38","\x11","\x00","\x00","\x00");
+	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\x05\x20\x01\x38\x11\x00\x00\x00",8,1000);
+	usleep(28*1000);
+
+	//_send_usb_msg("\x00","\x00","\xaa","\x00","\x00","\x00","\x20","\x3e");
+	usb_control_msg(dev,USB_TYPE_CLASS+USB_RECIP_INTERFACE,9,0x200,0,"\x00\x00\xAA\x00\x00\x00\x20\x3E",8,1000);
+	usleep(28*1000);
+
+	return 0;
+}
+*/
+
+//***************************************************************
+// Parse, format and submit weather values
+//***************************************************************
+
+// Unit conversion functions
+
+float c2f(float deg)
+{ return 1.8*deg+32;
+}
+
+float kmh2mph(float speed)
+{ return speed*0.621371192;
+}
+
+float kmh2ms(float speed)
+{ return speed / 3.6;
+}
+
+float hpa2in(float press)
+{ return press*0.0295300586467;
+}
+
+float mm2in(float size)
+{ return size*0.0393700787;
+}
+
+// There is no single conversion factor between lx and W/m2; there is a different conversion factor for every wavelength
+// and it is not possible to make a conversion unless one knows the spectral composition of the light.
+
+float lux2wattm2(float lux)
+{ return lux*1.4641/1000;
+}
+
+// Build the time index for the image records from lowpos to the current position 0 at address in one pass
+// Ages of 0 (only valid for the current record) and 0xFF are taken as read_period
+
+void ws_time_build(struct wtimes *x,uint16_t address,int lowpos,int data_count,time_t curtime,int last_age)
+{
+	int i,age;
+
+	if (lowpos<1-WS_TOTAL_ENTRIES || lowpos<1-WS_INDEX_SIZE || lowpos>0)
+	{	logger(LOG_WARNING,"ws_time_build","Position %d is outside the record ring",lowpos);
+		lowpos=lowpos>0?0:(1-WS_TOTAL_ENTRIES>1-WS_INDEX_SIZE?1-WS_TOTAL_ENTRIES:1-WS_INDEX_SIZE);
+	}
+	x->lowpos=lowpos;
+	x->oldest=lowpos<=1-data_count;
+	x->n=1-lowpos;
+	x->t[x->n-1]=curtime;
+	for (i=x->n-2;i>=0;i--)
+	{	age=i==x->n-2?last_age:img->mem[get_address(address,lowpos+i+1)];
+		if ((age==0 && i<x->n-2) || age==0xFF) age=read_period;
+		x->t[i]=x->t[i+1]-age*60;
+	}
+	logger(LOG_DEBUG,"ws_time_build","Time index of %d records, %d minutes",x->n,(int)(curtime-x->t[0])/60);
+}
+
+// Index of the last record written at or before t, -1 if all records are newer
+
+int ws_time_find(struct wtimes *x,time_t t)
+{
+	int lo=0,hi=x->n-1,m;
+
+	if (x->n==0 || x->t[0]>t) return -1;
+	while (lo<hi)
+	{	m=(lo+hi+1)/2;
+		if (x->t[m]<=t) lo=m;
+		else hi=m-1;
+	}
+	return lo;
+}
+
+// Time of the record at position, from the time index if the position is in it
+
+time_t ws_rec_time(int position,time_t curtime,int last_age)
+{
+	struct wtimes *x=&ws_times;
+
+	if (position-x->lowpos>=0 && position-x->lowpos<x->n)
+		return x->t[position-x->lowpos];
+	if (position==0)
+		return curtime;
+	return curtime-last_age*60+(position+1)*read_period*60;		// This is not very accurate as age can vary +-1 min for each record
+}
+
+// Build the rain index over the time index x for the image records at address
+// Records with lost sensors don't add rain, their counter is not trusted
+
+void ws_rain_build(struct wrain *r,struct wtimes *x,uint16_t address)
+{
+	uint8_t *b;
+	int i,tips,prev=-1,d;
+
+	r->x=x;
+	for (i=0;i<x->n;i++)
+	{	b=img->mem+get_address(address,x->lowpos+i);
+		r->cum[i]=i>0?r->cum[i-1]:0;
+		if (b[0x0F] & 64) continue;
+
+		tips=b[0x0D]+(b[0x0E]<<8);
+		if (prev>=0)
+		{	d=(tips-prev)&0xFFFF;
+			if (d<WS_RAIN_JUMP) r->cum[i]+=d*0.3*c.rain_factor;
+			else logger(LOG_WARNING,"ws_rain_build","Rain counter of position %d jumps from %d to %d, ignored",x->lowpos+i,prev,tips);
+		}
+		prev=tips;
+	}
+	logger(LOG_DEBUG,"ws_rain_build","Rain index of %d records, %.1f mm",x->n,x->n?r->cum[x->n-1]:0);
+}
+
+// Rain of the last minutes before the record at position (mm), -1 if the position or the start of
+// the window is not indexed. The record written last before the window is the base, if the index
+// starts at the oldest record of the station and there is none, the oldest record is taken
+
+float ws_rain_last(struct wrain *r,int position,int minutes)
+{
+	int i=position-r->x->lowpos,j;
+
+	if (i<0 || i>=r->x->n) return -1;
+	j=ws_time_find(r->x,r->x->t[i]-minutes*60);
+	if (j<0 && !r->x->oldest) return -1;
+	return r->cum[i]-r->cum[j<0?0:j];
+}
+
+// Rain since 0h local time of the day of the record at position (mm), -1 like ws_rain_last()
+
+float ws_rain_since0h(struct wrain *r,int position)
+{
+	int i=position-r->x->lowpos,j;
+	struct tm tm;
+
+	if (i<0 || i>=r->x->n) return -1;
+	localtime_r(&r->x->t[i],&tm);
+	tm.tm_hour=tm.tm_min=tm.tm_sec=0;
+	tm.tm_isdst=-1;
+	j=ws_time_find(r->x,mktime(&tm));
+	if (j<0 && !r->x->oldest) return -1;
+	return r->cum[i]-r->cum[j<0?0:j];
+}
+
+// Decode n raw records of ctx->entry_size bytes from raw into out[0..n-1], no global state is used
+// Rain is the calibrated total, rainhour and rainday need other records and are set to -1 here
+
+int ws_decode(struct wcontext *ctx,uint8_t *raw,int n,struct wrecord *out)
+{
+	static char *dir[]=
+	{
+		"N","NNE","NE","ENE","E","ESE","SE","SSE",
 		"S","SSW","SW","WSW","W","WNW","NW","NNW"
 	};
-	short dirdeg[]=
+	static short dirdeg[]=
 	{
 		0,23,45,68,90,113,135,158,
 		180,203,225,248,270,293,315,338
 	};
-	char errcount=0, sensorlost=0;
-	float lastrain;
+	struct calib *c=ctx->c;
+	struct wrecord *r;
+	uint8_t *buffer;
+	int i,ok=0;
 	short tempi,tempo;
 
-// Age of the record (in minutes)
-
-	w.age=buffer[0x00];
+	for (i=0;i<n;i++)
+	{	buffer=raw+i*ctx->entry_size;
+		r=out+i;
+		r->err=0;
+		r->datetime=0;
 
-	if (w.age>read_period+1)
-	{	logger(LOG_ERROR,"ws_parse","Age of record %d is not reasonable bigger than read_period %d",w.age,read_period);
-		errcount++;
-	}
-
-// Datetime
+// Age of the record (in minutes)
 
-	if (position==0)
-		w.datetime=curtime;
-	else
-		w.datetime=curtime-last_age*60+(position+1)*read_period*60;		// This is not very accurate as age can vary +-1 min for each record
+		r->age=buffer[0x00];
+		if (r->age>ctx->read_period+1) r->err|=WS_ERR_AGE;
 
 // Check loss of sensors
 
-	if (buffer[0x0F] & 64)
-	{	logger(LOG_ERROR,"ws_parse","Sensor contact lost");
-		sensorlost=1;
-	}
+		if (buffer[0x0F] & 64) r->err|=WS_ERR_SENSOR;
 
 // Inside Temperature (°C)
 
-	if (buffer[0x03] >= 0x80) tempi=buffer[0x02]+(buffer[0x03]<<8) ^ 0x7FFF;	//weather station uses top bit for sign and not normal
-                           else   tempi=buffer[0x02]+(buffer[0x03]<<8) ^ 0x0000;	//signed short, so we need to correct this with xor
-	w.tempin =(float)(tempi)/10*c.tempin_factor+c.tempin_offset;
-
-	if ((w.tempin > 100) || (w.tempin < -100)) 
-	{	logger(LOG_ERROR,"ws_parse","Temperature inside out of range: %f C",w.tempin);
-		errcount++;
-	}
+		if (buffer[0x03] >= 0x80) tempi=buffer[0x02]+(buffer[0x03]<<8) ^ 0x7FFF;	//weather station uses top bit for sign and not normal
+		                   else   tempi=buffer[0x02]+(buffer[0x03]<<8) ^ 0x0000;	//signed short, so we need to correct this with xor
+		r->tempin =(float)(tempi)/10*c->tempin_factor+c->tempin_offset;
+		if ((r->tempin > 100) || (r->tempin < -100)) r->err|=WS_ERR_TEMPIN;
 
-// Outside Temperature (°C)
+// Outside Temperature (°C), 255 means bad value
 
-	if (!sensorlost)
-	{
-		if (buffer[0x06] >= 0x80) tempo=buffer[0x05]+(buffer[0x06]<<8) ^ 0x7FFF;	//weather station uses top bit for sign and not normal
-	                           else   tempo=buffer[0x05]+(buffer[0x06]<<8) ^ 0x0000;	//signed short, so we need to correct this with xor
-		w.tempout=(float)(tempo)/10*c.tempout_factor+c.tempout_offset;
-	
-		if ((w.tempout > 100) || (w.tempout < -100))
-		{	logger(LOG_ERROR,"ws_parse","Temperature outside out of range: %f C",w.tempout);
-			errcount++;
+		if (!(r->err&WS_ERR_SENSOR))
+		{	if (buffer[0x06] >= 0x80) tempo=buffer[0x05]+(buffer[0x06]<<8) ^ 0x7FFF;
+			                   else   tempo=buffer[0x05]+(buffer[0x06]<<8) ^ 0x0000;
+			r->tempout=(float)(tempo)/10*c->tempout_factor+c->tempout_offset;
+			if ((r->tempout > 100) || (r->tempout < -100)) r->err|=WS_ERR_TEMPOUT;
 		}
-	}
-	else
-	{	w.tempout = 255; 								// 255 means bad value
-	}
-
+		else
+			r->tempout = 255;
 
 // Inside Humidity (%)
 
-	w.humin = floor((float)buffer[0x01]*c.humin_factor+c.humin_offset);
-	if ((w.humin > 100) || (w.humin == 0)) 
-	{	logger(LOG_ERROR,"ws_parse","Humidity inside out of range: %d %%",w.humin);
-		errcount++;
-	}
+		r->humin = floor((float)buffer[0x01]*c->humin_factor+c->humin_offset);
+		if ((r->humin > 100) || (r->humin == 0)) r->err|=WS_ERR_HUMIN;
 
-// Outside Humidity (%)
+// Outside Humidity (%), calculated humidity can be a maximum of 100 percent
 
-	if (!sensorlost)
-	{	w.humout = floor((float)buffer[0x04]*c.humout_factor+c.humout_offset);
-		if ((w.humout > 100) || (w.humout == 0)) 
-		{	logger(LOG_ERROR,"ws_parse","Humidity outside out of range: %d %%",w.humout);
-			w.humout=100;
+		if (!(r->err&WS_ERR_SENSOR))
+		{	r->humout = floor((float)buffer[0x04]*c->humout_factor+c->humout_offset);
+			if ((r->humout > 100) || (r->humout == 0))
+			{	r->err|=WS_ERR_HUMOUT;
+				r->humout=100;
+			}
 		}
-	}
-	else
-		w.humout=255;
+		else
+			r->humout=255;
 
 // Dew point (°C)
 
-	if (w.tempout<100 && w.tempout>-100 && w.humout <= 100 && w.humout>0)
-	{	float gama = (17.271*w.tempout)/(237.7+w.tempout) + log ((w.humout==0)?0.001:(float)w.humout/100);		//gama=aT/(b+T) + ln (RH/100)
-		w.tempdew = (237.7 * gama) / (17.271 - gama);									//Tdew= (b * gama) / (a - gama)
-	}
-	else
-	{	w.tempdew = 255;
-	}
+		if (r->tempout<100 && r->tempout>-100 && r->humout <= 100 && r->humout>0)
+		{	float gama = (17.271*r->tempout)/(237.7+r->tempout) + log ((r->humout==0)?0.001:(float)r->humout/100);	//gama=aT/(b+T) + ln (RH/100)
+			r->tempdew = (237.7 * gama) / (17.271 - gama);								//Tdew= (b * gama) / (a - gama)
+		}
+		else
+			r->tempdew = 255;
 
-// Wind speed (km/h)
+// Wind speed and gust (km/h)
 
-	if (sensorlost || buffer[0x09]==255)
-	{	w.windspeed=-1.0;
+		if ((r->err&WS_ERR_SENSOR) || buffer[0x09]==255)
+		{	r->windspeed=-1.0;
+			if (!(r->err&WS_ERR_SENSOR)) r->err|=WS_ERR_WIND;
+		}
+		else
+			r->windspeed=(float)(buffer[0x09])/10*3.6*c->windspeed_factor+c->windspeed_offset;
 
-		if (!sensorlost)
-		{	logger(LOG_ERROR,"ws_parse","Invalid windspeed: %f km/h",w.windspeed);
-			errcount++;
+		if ((r->err&WS_ERR_SENSOR) || buffer[0x0A]==255)
+		{	r->windgust=-1.0;
+			if (!(r->err&WS_ERR_SENSOR)) r->err|=WS_ERR_GUST;
 		}
-	}
-	else
-	{	w.windspeed=(float)(buffer[0x09])/10*3.6*c.windspeed_factor+c.windspeed_offset;
-	}
-	
+		else
+			r->windgust=(float)(buffer[0x0A])/10*3.6*c->windgust_factor+c->windgust_offset;
 
-// Wind gust (km/h)
+// Windchill temperature (°C)
 
-       if (sensorlost || buffer[0x0A]==255)
-	{	w.windgust=-1.0;
-		
-		if (!sensorlost)
-		{	logger(LOG_ERROR,"ws_parse","Invalid windgust: %f km/h",w.windgust);
-			errcount++;
+		if (r->tempout<100 && r->tempout>-100 && r->windspeed!=-1)
+		{	if (r->tempout<10.0)
+				r->tempchill=13.12 + 0.6215 * r->tempout - 11.37*pow(r->windspeed,0.16) + 0.3965*r->tempout*pow(r->windspeed,0.16);
+			else
+				r->tempchill=r->tempout;
+			if(r->tempout<r->tempchill) r->tempchill=r->tempout; 				// windchill can't be more than tempout
 		}
-	}
-	else
-	{      w.windgust=(float)(buffer[0x0A])/10*3.6*c.windgust_factor+c.windgust_offset;
-	}
+		else
+			r->tempchill=255;
 
-// Windchill temperature (°C)
+// Wind direction - named and degrees
 
-	if (w.tempout<100 && w.tempout>-100 && w.windspeed!=-1)
-	{	if (w.tempout<10.0)
-			w.tempchill=13.12 + 0.6215 * w.tempout - 11.37*pow(w.windspeed,0.16) + 0.3965*w.tempout*pow(w.windspeed,0.16);
+		if (!(r->err&WS_ERR_SENSOR))
+		{	strcpy (r->winddir,dir[buffer[0x0C]<sizeof(dir)/sizeof(dir[0])?buffer[0x0C]:0]);
+			r->winddeg=dirdeg[buffer[0x0C]<sizeof(dir)/sizeof(dir[0])?buffer[0x0C]:0]+c->winddir_offset;
+			if (r->winddeg<0) r->winddeg+=360;
+			if (r->winddeg>=360) r->winddeg-=360;
+		}
 		else
-			w.tempchill=w.tempout;
-		if(w.tempout<w.tempchill) w.tempchill=w.tempout; 				// windchill can't be more than tempout
-	}
-	else
-	{	w.tempchill=255;
-	}
+		{	strcpy (r->winddir,"ERR");
+			r->winddeg=-1;
+		}
 
-// Wind direction - named
+// Absolute and relative pressure (hPa)
 
-	if (!sensorlost)
-		strcpy (w.winddir,dir[buffer[0x0C]<sizeof(dir)/sizeof(dir[0])?buffer[0x0C]:0]);
-	else
-		strcpy (w.winddir,"ERR");
+		r->pressabs = (float)(buffer[0x07]+(buffer[0x08]<<8))/10*c->pressabs_factor+c->pressabs_offset;
+		if (r->pressabs < 900 || r->pressabs>1100) r->err|=WS_ERR_PRESS;
 
-// Wind direction - degrees
+		if (r->pressabs > 900 && r->pressabs<1100 && r->tempout<100 && r->tempout>-100)
+		{	float m=ctx->altitude / (18429.1 + 67.53 * r->tempout + 0.003 * ctx->altitude); 		// Power exponent to correction function
+			r->pressrel=r->pressabs * pow(10,m);
+		}
+		else
+			r->pressrel=-1;
 
-	if (!sensorlost)
-	{	w.winddeg=dirdeg[buffer[0x0C]<sizeof(dir)/sizeof(dir[0])?buffer[0x0C]:0]+c.winddir_offset;
-		if (w.winddeg<0) w.winddeg+=360;
-		if (w.winddeg>=360) w.winddeg-=360;
-	}
-	else
-		w.winddeg=-1;
+// Rain total (mm), probably invalid if sensors are lost (even if values were read)
 
-// Absolute pressure (hPa)
+		r->rain=(r->err&WS_ERR_SENSOR)?-1:(float)(buffer[0x0D]+(buffer[0x0E]<<8))*0.3*c->rain_factor+c->rain_offset;
+		r->rainhour=r->rainday=-1;
 
-	w.pressabs = (float)(buffer[0x07]+(buffer[0x08]<<8))/10*c.pressabs_factor+c.pressabs_offset;
+// UV & Illumination (WH3080 only)
 
-	if (w.pressabs < 900 || w.pressabs>1100)
-	{	logger(LOG_ERROR,"ws_parse","Pressure out of range: %f hPa",w.pressabs);
-		errcount++;
-	}
+		if (ctx->entry_size==0x14 && !(r->err&WS_ERR_SENSOR))
+		{	r->uv = floor((float)buffer[19]*c->uv_factor+c->uv_offset);
+			r->illu = (float)(buffer[16]+(buffer[17]<<8)+(buffer[18]<<16))*0.1*c->illu_factor+c->illu_offset;
+		}
+		else
+		{	r->uv=-1.0;
+			r->illu=-1.0;
+		}
 
-// Relative pressure (hPa)
+// Ignore record if too many errors, though connection to outdoor unit is not lost
 
-	if (w.pressabs > 900 && w.pressabs<1100 && w.tempout<100 && w.tempout>-100)
-	{	float m=altitude / (18429.1 + 67.53 * w.tempout + 0.003 * altitude); 			// Power exponent to correction function
-		w.pressrel=w.pressabs * pow(10,m);
+		r->ok=!(r->err&WS_ERR_SENSOR) && ws_errcount(r->err)<3;
+		ok+=r->ok;
 	}
-	else
-	{	w.pressrel=-1;
+
+	return ok;
+}
+
+// Decode count records of the ring image starting at address, wrapping from the end of the ring to its start
+
+int ws_decode_ring(struct wcontext *ctx,uint8_t *image,uint16_t address,int count,struct wrecord *out)
+{
+	int n,ok=0;
+
+	while (count>0)
+	{	n=(WS_MAX_ENTRY_ADDR-address)/ctx->entry_size;
+		if (n>count) n=count;
+		ok+=ws_decode(ctx,image+address,n,out);
+		out+=n;
+		count-=n;
+		address=WS_MIN_ENTRY_ADDR;
 	}
+	return ok;
+}
+
+// Number of errors counting against a record, lost sensors and clipped outside humidity don't count
+
+int ws_errcount(unsigned short err)
+{
+	int n=0;
+
+	err&=~(WS_ERR_SENSOR|WS_ERR_HUMOUT);
+	for (;err;err&=err-1) n++;
+	return n;
+}
+
+// Parse memory buffer and fill the wrecord static structure w with all weather values
+// Thin wrapper around ws_decode() which adds datetime, rain of the last 60 min and since 0h and the logging
+
+int ws_parse(uint8_t *buffer, float rainhour, float rainday, time_t curtime, int position, int last_age)
+{
+	struct wcontext ctx={&c,altitude,read_period,ws_entry_size};
+
+	ws_decode(&ctx,buffer,1,&w);
+	ws_view_reset();
 
-// Rain total (mm)
+	if (w.err&WS_ERR_AGE) logger(LOG_ERROR,"ws_parse","Age of record %d is not reasonable bigger than read_period %d",w.age,read_period);
+	if (w.err&WS_ERR_SENSOR) logger(LOG_ERROR,"ws_parse","Sensor contact lost");
+	if (w.err&WS_ERR_TEMPIN) logger(LOG_ERROR,"ws_parse","Temperature inside out of range: %f C",w.tempin);
+	if (w.err&WS_ERR_TEMPOUT) logger(LOG_ERROR,"ws_parse","Temperature outside out of range: %f C",w.tempout);
+	if (w.err&WS_ERR_HUMIN) logger(LOG_ERROR,"ws_parse","Humidity inside out of range: %d %%",w.humin);
+	if (w.err&WS_ERR_HUMOUT) logger(LOG_ERROR,"ws_parse","Humidity outside out of range, set to %d %%",w.humout);
+	if (w.err&WS_ERR_WIND) logger(LOG_ERROR,"ws_parse","Invalid windspeed: %f km/h",w.windspeed);
+	if (w.err&WS_ERR_GUST) logger(LOG_ERROR,"ws_parse","Invalid windgust: %f km/h",w.windgust);
+	if (w.err&WS_ERR_PRESS) logger(LOG_ERROR,"ws_parse","Pressure out of range: %f hPa",w.pressabs);
 
-	w.rain = (float)(buffer[0x0D]+(buffer[0x0E]<<8))*0.3*c.rain_factor+c.rain_offset;
+// Datetime
+
+	w.datetime=ws_rec_time(position,curtime,last_age);
 
-// Rain last 60 mins (mm) - NB: last rain is set even if sensors were lost
+// Rain last 60 mins (mm)
 
-	lastrain = (float)(buffer60[0x0D]+(buffer60[0x0E]<<8))*0.3*c.rain_factor+c.rain_offset;
-	w.rainhour = w.rain - lastrain;
+	w.rainhour = rainhour;
 	if (w.rainhour<0 || w.rainhour>50)
-	{	logger(LOG_ERROR,"ws_parse","Rainhour is out of range, rain=%f, lastrain=%f",w.rain,lastrain);
+	{	logger(LOG_ERROR,"ws_parse","Rainhour is out of range: %f mm",rainhour);
 		w.rainhour=-1;
-		errcount++;
+		w.err|=WS_ERR_RAINHOUR;
 
 // TEST: Drop the record with negative rain (something strange happens here)
 
@@ -1557,64 +2983,30 @@ int ws_parse(uint8_t *buffer, uint8_t *buffer60, uint8_t *buffer0h, time_t curti
 		return 2;
 	}
 
+// Rain from 0h (mm)
 
-// Rain from 0h (mm) - NB: last rain is set even if sensors were lost
-
-	lastrain = (float)(buffer0h[0x0D]+(buffer0h[0x0E]<<8))*0.3*c.rain_factor+c.rain_offset;
-	w.rainday = w.rain - lastrain;
+	w.rainday = rainday;
 	if (w.rainday<0 || w.rainday>100)
-	{	logger(LOG_ERROR,"ws_parse","Rainday is out of range rain=%f, lastrain=%f",w.rain,lastrain);
+	{	logger(LOG_ERROR,"ws_parse","Rainday is out of range: %f mm",rainday);
 		w.rainday=-1;
-		errcount++;
-
-// TEST: Drop the record with negative rain (something strange happens here)
-
+		w.err|=WS_ERR_RAINDAY;
 		w.ok=0;
 		return 2;
 	}
 
 // All rain stuff is probably invalid if sensors are lost (even if values were read)
 
-	if (sensorlost)
-	{	w.rain = -1;
-		w.rainhour = -1;
+	if (w.err&WS_ERR_SENSOR)
+	{	w.rainhour = -1;
 		w.rainday = -1;
 	}
 
-// UV & Illumination (WH3080 only)
-
-	if(strcasecmp(ws_type,"WH3080")==0 || strcasecmp(ws_type,"WH3081")==0)
-	{	
-		if (!sensorlost)
-		{	w.uv = floor((float)buffer[19]*c.uv_factor+c.uv_offset);
- 			w.illu = (float)(buffer[16]+(buffer[17]<<8)+(buffer[18]<<16))*0.1*c.illu_factor+c.illu_offset;
- 		}
- 		else
- 		{	w.uv=-1.0;
-			w.illu=-1.0;
- 		}
-	}
-	else
-	{	w.uv=-1.0;
-		w.illu=-1.0;
-	}
-	
-
 // Check if values are reasonable...
 
-	if (errcount>=3)					// Ignore record if too many errors, though connection to outdoor unit is not lost
-	{	w.ok=0;
+	if (ws_errcount(w.err)>=3)				// Ignore record if too many errors, though connection to outdoor unit is not lost
 		return 1;
-	}
-	else if (sensorlost)
-	{	w.ok=0;	
-		return 0;
-	}
 	else
-	{	w.ok=1;
 		return 0;
-	}
-		
 }
 
 /*
@@ -1626,441 +3018,881 @@ static size_t write_callback(char *buffer, size_t size,size_t nitems,void *outpu
 }
 */
 
-int ws_submit(char *server_url, char** filebuf)
+// Get server_url, the reply is kept in reply (cut off at size-1 bytes) or dropped if reply is NULL
+
+int ws_submit(char *server_url, char *reply, int size)
 {
-	if (*filebuf) 
-	{	free(*filebuf);
-		*filebuf=NULL;
-	}
+	int l;
 
 	http_setTimeout(15);
-	int l=http_fetch(server_url, filebuf);
+	if (reply!=NULL)
+		l=http_fetch_buf(server_url, reply, size);
+	else
+		l=http_fetch(server_url, NULL);
 	
 	if (l>=0)
-	{	logger(LOG_DEBUG,"ws_submit","http_fetcher performed OK content: %s", *filebuf);
+	{	logger(LOG_DEBUG,"ws_submit","http_fetcher performed OK content: %s", reply!=NULL? reply : "(dropped)");
 		return 0;
 	}
 	else
-	{	logger(LOG_WARNING,"ws_submit","http_fetcher failed with message \"%s\"", http_strerror());
-		return 1;
+	{	logger(LOG_WARNING,"ws_submit","http_fetcher failed with message \"%s\"", http_strerror());
+		return 1;
+	}
+}
+
+// Queue a URL for ws_submit_all(), which frees it
+
+int ws_submit_add(char *url)
+{
+	if (ws_batch_counter>=sizeof(ws_batch)/sizeof(ws_batch[0])) ws_submit_all();
+	ws_batch[ws_batch_counter].url=url;
+	ws_batch[ws_batch_counter++].maxBody=-1;	// Only the status counts, the reply is dropped
+	return 0;
+}
+
+// Submit all queued URLs concurrently, the slowest server bounds the time taken
+
+int ws_submit_all(void)
+{
+	int i,n;
+
+	if (ws_batch_counter==0) return 0;
+
+	http_setTimeout(15);
+	n=http_fetch_multi(ws_batch,ws_batch_counter);
+	if (n<0)
+		logger(LOG_WARNING,"ws_submit_all","http_fetcher failed with message \"%s\"", http_strerror());
+
+	for (i=0;i<ws_batch_counter;i++)
+	{	if (ws_batch[i].length>=0)
+			logger(LOG_DEBUG,"ws_submit_all","http_fetcher performed OK for %s (%d bytes)", ws_batch[i].url, ws_batch[i].length);
+		else if (n>=0)
+			logger(LOG_WARNING,"ws_submit_all","Submitting to server %s failed with message \"%s\"", ws_batch[i].url, ws_batch[i].error);
+		free(ws_batch[i].body);
+		free((char *)ws_batch[i].url);
+	}
+	i=n==ws_batch_counter? 0 : 1;
+	ws_batch_counter=0;
+	return i;
+}
+
+// Make alarm specified by alm for weather record w
+
+int ws_alarm (struct wrecord *w, struct walarm *alm)
+{	
+	char rv=0;
+
+	if (alm->url != NULL)
+	{	char *output;
+		rv=ws_format(alm->url,&output,1,"","","");
+		if (rv!=0) 
+			logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
+		else
+		{	logger(LOG_DEBUG,"main","Submitting to alarm URL: %s", output);
+			rv=ws_submit(output,NULL,0); // NB: Error in ws_submit will be ignored, just warning
+			if (rv!=0) logger(LOG_WARNING,"main","Submitting to alarm URL %s failed", output);
+		}
+		free(output);
+	}
+
+	rv=0;
+
+	if (alm->run != NULL)
+	{	char *output;
+		rv=ws_format(alm->run,&output,1,"","","");
+		if (rv!=0) 
+			logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
+		else
+		{	logger(LOG_WARNING,"main","Launching command: %s", output);
+			system(output); // NB: Errors are not recognizable here
+		}
+		free(output);
+	}
+
+	rv=0;
+	
+	if (alm->email != NULL && frewe_server_url_alarm!=NULL)
+	{	struct wbuf b;
+		char *output;
+
+		ws_buf_init(&b,strlen(frewe_server_url_alarm)+strlen(alm->email)+64);
+		ws_buf_printf(&b,"%s&email=%s&type=%s%%20%0.1f",frewe_server_url_alarm,alm->email,alm->type,alm->threshold);
+		output=ws_buf_done(&b);
+		if (!output)
+		{	logger(LOG_ERROR,"main","Could not allocate memory for alarm email URL");
+			rv=1;
+		}
+		else
+		{	logger(LOG_DEBUG,"main","Submitting to alarm email URL: %s", output);
+			rv=ws_submit(output,NULL,0); // NB: Error in ws_submit will be ignored, just warning
+			if (rv!=0) logger(LOG_WARNING,"main","Submitting to alarm email URL %s failed", output);
+			free(output);
+		}
+	}
+	
+	return 0;		// Errors will be ignored
+}
+
+
+
+// String builder
+
+void ws_buf_init(struct wbuf *b, size_t size)
+{
+	b->s=malloc(size+1);
+	b->len=0;
+	b->size=b->s?size:0;
+	b->failed=b->s==NULL;
+	if (b->s) *b->s=0;
+}
+
+// Make room for n more bytes, the size at least doubles so appends stay linear
+// NB: no logging here, logger() itself builds its error URL with this
+
+int ws_buf_grow(struct wbuf *b, size_t n)
+{
+	char *s;
+	size_t size;
+
+	if (b->failed) return 1;
+	if (b->len+n<=b->size) return 0;
+
+	size=b->size*2;
+	if (size<b->len+n) size=b->len+n;
+	s=realloc(b->s,size+1);
+	if (!s)
+	{	b->failed=1;
+		return 1;
+	}
+	b->s=s;
+	b->size=size;
+	return 0;
+}
+
+void ws_buf_put(struct wbuf *b, char *text, size_t n)
+{
+	if (ws_buf_grow(b,n)) return;
+	memcpy(b->s+b->len,text,n);
+	b->len+=n;
+	b->s[b->len]=0;
+}
+
+void ws_buf_puts(struct wbuf *b, char *text)
+{
+	ws_buf_put(b,text,strlen(text));
+}
+
+// Append text, URL encoded if urlencode is set, the encoder writes straight into the buffer
+
+void ws_buf_putenc(struct wbuf *b, char *text, unsigned char urlencode)
+{
+	size_t n=strlen(text);
+
+	if (!urlencode)
+	{	ws_buf_put(b,text,n);
+		return;
+	}
+	if (ws_buf_grow(b,n*3)) return;
+	b->len+=ws_urlenc(b->s+b->len,text,n);
+}
+
+// Append printf formatted text, the free space is tried first and the call repeated once if it did not fit
+
+void ws_buf_vprintf(struct wbuf *b, char *fmt, va_list args)
+{
+	va_list copy;
+	int n;
+
+	if (b->failed) return;
+	va_copy(copy,args);
+	n=vsnprintf(b->s+b->len,b->size-b->len+1,fmt,copy);
+	va_end(copy);
+	if (n<0)
+	{	b->failed=1;
+		return;
+	}
+	if (b->len+n>b->size)
+	{	if (ws_buf_grow(b,n)) return;
+		vsnprintf(b->s+b->len,b->size-b->len+1,fmt,args);
+	}
+	b->len+=n;
+}
+
+void ws_buf_printf(struct wbuf *b, char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args,fmt);
+	ws_buf_vprintf(b,fmt,args);
+	va_end(args);
+}
+
+// Finish the string and hand it over to the caller, NULL if any append failed
+
+char *ws_buf_done(struct wbuf *b)
+{
+	if (b->failed)
+	{	free(b->s);
+		b->s=NULL;
+	}
+	return b->s;
+}
+
+
+// Compile a ws_format() template into an op list, literal spans are merged and escapes are encoded here
+// already, so executing it only copies text and writes the fields
+
+struct wprog *ws_compile(char *format, unsigned char urlencode)
+{
+	struct wprog *prog;
+	struct wop *op=NULL;
+	char *t,*enc,lit[2],encbuf[4],esc;
+	int i,l=strlen(format);
+
+	prog=malloc(sizeof(struct wprog));
+	if (prog) prog->op=malloc((l+1)*sizeof(struct wop));
+	if (prog) prog->text=malloc(l*3+1);
+	if (!prog || !prog->op || !prog->text)
+	{	logger(LOG_ERROR,"ws_compile","Could not allocate memory for template '%s'",format);
+		if (prog) 
+		{	free(prog->op);
+			free(prog->text);
+			free(prog);
+		}
+		return NULL;
+	}
+	prog->format=format;
+	prog->urlencode=urlencode;
+	prog->n=0;
+	prog->size=0;
+	t=prog->text;
+
+	for (;*format;format++)
+	{	lit[0]=lit[1]=0;
+		esc=0;
+		if (*format=='%')
+		{	if (!*++format) break;
+			if (*format=='%')
+				lit[0]='%';
+			else
+			{	for (i=0;i<sizeof(wfield)/sizeof(wfield[0]) && wfield[i].code!=*format;i++) {}
+				if (i<sizeof(wfield)/sizeof(wfield[0]))
+				{	op=&prog->op[prog->n++];
+					op->f=&wfield[i];
+					op->enc=*format=='Z'?0:urlencode;		// Force no encoding for : in HH:MM
+					op->text=NULL;
+					op->len=0;
+					prog->size+=WS_FIELD_SIZE;
+				}
+				continue;
+			}
+		}
+		else if (*format=='\\')
+		{	if (!*++format) break;
+			if (*format=='n') lit[0]='\n';
+			else if (*format=='r') lit[0]='\r';
+			else if (*format=='t') lit[0]='\t';
+			else continue;
+			esc=1;
+		}
+		else
+			lit[0]=*format;
+
+// Literal text, escapes are encoded like fields, other characters never
+
+		enc=lit;
+		if (urlencode && esc) ws_urlenc(enc=encbuf,lit,1);
+		if (!op || op->f)
+		{	op=&prog->op[prog->n++];
+			op->f=NULL;
+			op->enc=0;
+			op->text=t;
+			op->len=0;
+		}
+		strcpy(t,enc);
+		t+=strlen(enc);
+		op->len+=strlen(enc);
+		prog->size+=strlen(enc);
+	}
+
+	return prog;
+}
+
+// Compiled program of a template, templates are compiled on first use and kept
+
+struct wprog *ws_program(char *format, unsigned char urlencode)
+{
+	static struct wprog **progs=NULL;
+	static int n=0;
+	struct wprog **p;
+	int i;
+
+	for (i=0;i<n;i++)
+		if (progs[i]->format==format && progs[i]->urlencode==urlencode) return progs[i];
+
+	p=realloc(progs,(n+1)*sizeof(struct wprog *));
+	if (!p) return NULL;
+	progs=p;
+	progs[n]=ws_compile(format,urlencode);
+	return progs[n]?progs[n++]:NULL;
+}
+
+// Write v in decimal like printf("%d") and return the length
+
+int ws_itoa(char *out, long v)
+{
+	char tmp[24],*t=tmp+sizeof(tmp),*p=out;
+	unsigned long n=v<0?-(unsigned long)v:v;
+
+	do
+	{	*--t='0'+n%10;
+		n/=10;
+	} while (n);
+	if (v<0) *p++='-';
+	while (t<tmp+sizeof(tmp)) *p++=*t++;
+	*p=0;
+	return p-out;
+}
+
+// Write v with dec (0..3) decimals like printf("%0.*f") and return the length. The float is split into
+// mantissa and exponent, scaled by 10^dec as an integer and rounded half to even like glibc does, so
+// there is no floating point arithmetic. Values from 2^32 on, infinity and NaN are left to printf.
+
+int ws_ftoa(char *out, float v, int dec)
+{
+	static const uint32_t p10[]={1,10,100,1000};
+	char tmp[24],*t=tmp+sizeof(tmp),*p=out;
+	uint32_t bits,m;
+	uint64_t q,n,r,half;
+	int e,i;
+
+	memcpy(&bits,&v,sizeof(bits));
+	e=(bits>>23)&0xFF;
+	m=bits&0x7FFFFF;
+	if (e>150+8 || dec<0 || dec>3) return sprintf(out,"%0.*f",dec,v);
+	if (e) m|=0x800000; else e=1;		// Denormals have no hidden bit
+
+// v=m*2^(e-150), the scaled value q=m*10^dec is below 2^34
+
+	e-=150;
+	q=(uint64_t)m*p10[dec];
+	if (e>=0)
+		n=q<<e;
+	else if (e<-35)
+		n=0;
+	else
+	{	n=q>>-e;
+		r=q&((1ULL<<-e)-1);
+		half=1ULL<<(-e-1);
+		if (r>half || (r==half && (n&1))) n++;
+	}
+
+	for (i=0;i<=dec || n;i++)
+	{	if (i==dec && dec) *--t='.';
+		*--t='0'+n%10;
+		n/=10;
 	}
+	if (bits>>31) *p++='-';			// Also -0.0 like printf
+	while (t<tmp+sizeof(tmp)) *p++=*t++;
+	*p=0;
+	return p-out;
 }
 
-// Make alarm specified by alm for weather record w
+// Forget the rendered text, w holds a new record
 
-int ws_alarm (struct wrecord *w, struct walarm *alm)
-{	
-	char rv=0;
+void ws_view_reset(void)
+{
+	ws_view.serial++;
+}
 
-	if (alm->url != NULL)
-	{
-		char *output=malloc(strlen(alm->url)+100);
-		if (!output)
-		{	logger(LOG_ERROR,"main","Could not allocate %u bytes for output",strlen(alm->url)+100);
-			rv=1;
-		}
-		else
-		{	rv=ws_format(alm->url,output,1,"","","");
-			if (rv!=0) 
-				logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
-			else
-			{	logger(LOG_DEBUG,"main","Submitting to alarm URL: %s", output);
-				rv=ws_submit(output,&filebuf); // NB: Error in ws_submit will be ignored, just warning
-				if (rv!=0) logger(LOG_WARNING,"main","Submitting to alarm URL %s failed", output);
-			}
-			free(output);
-		}
-	}
+// Text of placeholder f for the current record, URL encoded if urlencode is set, NULL if the value fails
+// its check. Conversions, strftime() and encoding are done once per record.
 
-	rv=0;
+char *ws_view_text(struct wfield *f, unsigned char urlencode, int *len)
+{
+	struct wvfield *v=&ws_view.f[f-wfield];
+	struct tm *tm;
+	float x;
+	int u;
+
+	if (v->serial[0]!=ws_view.serial)
+	{	v->bad=0;
+		switch (f->type)
+		{	case WF_FLOAT:
+			case WF_SHORT:
+				x=f->type==WF_FLOAT?*(float *)((char *)&w+f->offset):*(short *)((char *)&w+f->offset);
+				if ((f->check==WF_TEMP && (x>100 || x<-100)) || (f->check==WF_HUM && (x>100 || x==0)) ||
+				    (f->check==WF_PRESS && (x<900 || x>1100)) || (f->check==WF_NEG1 && x==-1))
+				{	v->bad=1;
+					v->len[0]=0;
+				}
+				else if (f->type==WF_SHORT)
+					v->len[0]=ws_itoa(v->text,*(short *)((char *)&w+f->offset));
+				else
+					v->len[0]=ws_ftoa(v->text,f->conv?f->conv(x):x,f->dec);
+				break;
 
-	if (alm->run != NULL)
-	{
-		char *output=malloc(strlen(alm->run)+100);
-		if (!output)
-		{	logger(LOG_ERROR,"main","Could not allocate %u bytes for output",strlen(alm->run)+100);
-			rv=1;
-		}
-		else
-		{	rv=ws_format(alm->run,output,1,"","","");
-			if (rv!=0) 
-				logger(LOG_ERROR,"main","Error formatting data return code %d", rv);
-			else
-			{	logger(LOG_WARNING,"main","Launching command: %s", output);
-				system(output); // NB: Errors are not recognizable here
-			}
-			free(output);
+			case WF_TEXT:
+				v->len[0]=snprintf(v->text,WS_VIEW_TEXT,"%s",(char *)&w+f->offset);
+				break;
+
+			case WF_LOCAL:
+			case WF_UTC:
+				u=f->type==WF_UTC;
+				tm=&ws_view.tm[u];
+				if (ws_view.tmserial[u]!=ws_view.serial)
+				{	if (u) gmtime_r(&w.datetime,tm); else localtime_r(&w.datetime,tm);
+					ws_view.tmserial[u]=ws_view.serial;
+				}
+				v->len[0]=strftime(v->text,WS_VIEW_TEXT,f->fmt,tm);
+				break;
+
+			default:
+				return NULL;
 		}
+		if (v->len[0]>=WS_VIEW_TEXT) v->len[0]=WS_VIEW_TEXT-1;
+		v->serial[0]=ws_view.serial;
 	}
+	if (v->bad) return NULL;
 
-	rv=0;
-	
-	if (alm->email != NULL && frewe_server_url_alarm!=NULL)
-	{
-		char *output=malloc(strlen(frewe_server_url_alarm)+strlen(alm->email)+100);
-		if (!output)
-		{	logger(LOG_ERROR,"main","Could not allocate %u bytes for output",strlen(frewe_server_url_alarm)+strlen(alm->email)+100);
-			rv=1;
-		}
-		else
-		{	sprintf(output,"%s&email=%s&type=%s%%20%0.1f",frewe_server_url_alarm,alm->email,alm->type,alm->threshold);
-			logger(LOG_DEBUG,"main","Submitting to alarm email URL: %s", output);
-			rv=ws_submit(output,&filebuf); // NB: Error in ws_submit will be ignored, just warning
-			if (rv!=0) logger(LOG_WARNING,"main","Submitting to alarm email URL %s failed", output);
-			free(output);
-		}
+	if (!urlencode)
+	{	*len=v->len[0];
+		return v->text;
 	}
-	
-	return 0;		// Errors will be ignored
+	if (v->serial[1]!=ws_view.serial)
+	{	v->len[1]=ws_urlenc(v->enctext,v->text,v->len[0]);
+		v->serial[1]=ws_view.serial;
+	}
+	*len=v->len[1];
+	return v->enctext;
 }
 
+// Run a compiled template against wrecord w, appending to b
 
-
-// Format wrecord w according to format string into out
-
-void strcatenc(char *out,char *text,unsigned char urlencode)
+int ws_exec(struct wprog *prog, struct wbuf *b, char *user, char *pass, char *error)
 {
-	char *encoded=NULL;
-	if (urlencode)
-	{	encoded=URLencode(text);
-		if (!encoded)
-		{	logger(LOG_ERROR,"main","URLencode could not allocate memory for '%s'",text);
+	struct wop *op,*end=prog->op+prog->n;
+	struct wfield *f;
+	char *s;
+	int len;
+
+	ws_buf_grow(b,prog->size);
+	for (op=prog->op;op<end;op++)
+	{	f=op->f;
+		if (!f)
+			ws_buf_put(b,op->text,op->len);
+		else if (f->type==WF_ARG)
+		{	s=f->code=='x'?user:f->code=='X'?pass:ws_type;
+			ws_buf_putenc(b,s,op->enc);
 		}
+		else if ((s=ws_view_text(f,op->enc,&len)))
+			ws_buf_put(b,s,len);
 		else
-		{	strcat(out,encoded);
-			free(encoded);
-		}
+			ws_buf_putenc(b,error,op->enc);
 	}
-	else
-	{	strcat(out,text);
+
+	return b->failed;
+}
+
+// Format wrecord w according to format string, *out is set to a malloc()ed string of exactly the
+// needed size or NULL on error and must be freed by the caller
+
+int ws_format(char *format, char **out, unsigned char urlencode, char *user, char *pass, char *error)
+{
+	struct wprog *prog=ws_program(format,urlencode);
+	struct wbuf b;
+
+	*out=NULL;
+	if (!prog) return 1;
+	ws_buf_init(&b,prog->size);
+	if (ws_exec(prog,&b,user,pass,error))
+	{	logger(LOG_ERROR,"ws_format","Could not allocate memory for output of '%s'",format);
+		free(b.s);
+		return 1;
 	}
-	return;
+	*out=ws_buf_done(&b);
+	return 0;
 }
 
 
-int ws_format(char *format, char *out, unsigned char urlencode, char *user, char *pass, char *error)
+int ws_dump(uint16_t address,uint8_t *data,uint16_t size,uint8_t w)
 {
-	char buf[100];
+	uint16_t i,j,s;
+	char *buf,*p;
 
-	strcpy(out,"");
+	s=8+(w*5)+1;
+	logger(LOG_DEBUG,"ws_dump","Allocate %u bytes for temporary buffer",s);
+	buf=malloc(s);
+	if (!buf) logger(LOG_WARNING,"ws_dump","Could not allocate %u bytes for temporary buffer, verbose dump enabled",s);
 
-	for (;*format;format++)
+	logger(LOG_INFO,"ws_dump","Dump %u bytes from address 0x%04X",size,address);
+	for (i=0;i<size && buf && data;)
 	{
-		if (*format=='%')
+		if (buf) p=buf+sprintf(buf,"0x%04X:",address+i);
+		for (j=0;j<w && i<size;i++,j++)
 		{
-			switch (*++format)
+			if (buf)
 			{
-				case 'h': // inside humidity %
-					if (w.humin>100 || w.humin==0)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%d",out,w.humin);
-					break;
+				p+=sprintf(p," 0x%02X",data[i]);
+			} else
+			{
+				logger(LOG_INFO,"ws_dump","0x%04X: 0x%02X",address+i,data[i]);
+			}
+		}
+		if (buf) logger(LOG_INFO,"ws_dump",buf);
+	}
 
-				case 'H': // outside humidity %
-					if (w.humout>100 || w.humout==0)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%d",out,w.humout);
-					break;
+	return 0;
+}
 
-				case 'I': // inside temperature C
-					if (w.tempin>100 || w.tempin<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.tempin);
-					break;
+// Stream size bytes from address of the station memory to file (stdout if NULL or "-") in the given format
+// The range is read in chunks of WS_READ_CHUNK bytes, so any length up to the full 64 KB image can be exported
 
-				case 'i': // inside temperature F
-					if (w.tempin>100 || w.tempin<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,c2f(w.tempin));
-					break;
+int ws_export(struct wsession *s,uint32_t address,uint32_t size,char *format,char *file)
+{
+	struct wexport *e=NULL;
+	uint32_t end,chunk,n;
+	uint8_t *data;
+	char *obuf=NULL;
+	FILE *fp;
+	int i,rv=0,es=0;
+
+	for (i=0;i<sizeof(wexport)/sizeof(wexport[0]);i++)
+		if (strcasecmp(format,wexport[i].name)==0) e=&wexport[i];
+	if (e==NULL)
+	{	logger(LOG_ERROR,"ws_export","Unknown dump format %s",format);
+		return 1;
+	}
 
-				case 'O': // outside temperature C
-					if (w.tempout>100 || w.tempout<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.tempout);
-					break;
+	if (address>=WS_MAX_ENTRY_ADDR) address=WS_MAX_ENTRY_ADDR-1;
+	end=address+size;
+	if (end>WS_MAX_ENTRY_ADDR) end=WS_MAX_ENTRY_ADDR;
+	chunk=WS_READ_CHUNK;
+
+// Records are exported whole, the entry size is not set yet when options are parsed
+
+	if (e->write==ws_export_rec)
+	{	es=(strcasecmp(ws_type,"WH3080")==0 || strcasecmp(ws_type,"WH3081")==0)?0x14:0x10;
+		if (address<WS_MIN_ENTRY_ADDR) address=WS_MIN_ENTRY_ADDR;
+		address-=(address-WS_MIN_ENTRY_ADDR)%es;
+		if (end<address) end=address;		// Range without history records, nothing to export
+		end-=(end-address)%es;
+		chunk-=chunk%es;
+		ws_entry_size=es;
+	}
 
-				case 'o': // outside temperature F
-					if (w.tempout>100 || w.tempout<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,c2f(w.tempout));
-					break;
+	if (file==NULL || strcmp(file,"-")==0)
+		fp=stdout;
+	else
+	{	fp=fopen(file,"wb");
+		if (fp==NULL)
+		{	logger(LOG_ERROR,"ws_export","Could not open %s for writing",file);
+			return 1;
+		}
+	}
 
-				case 'E': // dew point C
-					if (w.tempdew>100 || w.tempdew<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.tempdew);
-					break;
+// Large output buffer, stdout keeps its buffer for further -d options
 
-				case 'e': // dew point F
-					if (w.tempdew>100 || w.tempdew<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,c2f(w.tempdew));
-					break;
+	if (e->write!=ws_export_log)
+	{	if (fp!=stdout)
+		{	obuf=malloc(WS_EXPORT_BUFFER);
+			if (obuf) setvbuf(fp,obuf,_IOFBF,WS_EXPORT_BUFFER);
+		}
+		else
+			ws_stdout_buffer();
+	}
 
-				case 'C': // windchill temperature C
-					if (w.tempchill>100 || w.tempchill<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.tempchill);
-					break;
+	data=malloc(chunk);
+	if (!data)
+	{	logger(LOG_ERROR,"ws_export","Could not allocate %u bytes for read buffer",chunk);
+		rv=1;
+	}
 
-				case 'c': // windchill temperature F
-					if (w.tempchill>100 || w.tempchill<-100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,c2f(w.tempchill));
-					break;
+	logger(LOG_INFO,"ws_export","Export %u bytes from address 0x%04X as %s",end-address,address,e->name);
+	if (e->write==ws_export_rec && data)
+		fprintf(fp,"addr\tage\thumin\ttempin\thumout\ttempout\tpress\twind\tgust\tdir\train\tstatus%s\n",es==0x14?"\tlux\tuv":"");
 
-				case 'W': // wind speed kmh
-					if (w.windspeed==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.windspeed);
-					break;
+	for (;rv==0 && address<end;address+=n)
+	{	n=end-address>chunk?chunk:end-address;
+		rv=ws_session_read(s,address,data,n);
+		if (rv==0) rv=e->write(fp,address,data,n);
+	}
 
-				case 'w': // wind speed mph
-					if (w.windspeed==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,kmh2mph(w.windspeed));
-					break;
+	if (fp!=stdout) fclose(fp);
+	else fflush(fp);
+	free(obuf);
+	free(data);
 
-				case 'v': // wind speed ms
-					if (w.windspeed==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,kmh2ms(w.windspeed));
-					break;
+	return rv;
+}
 
-				case 'G': // wind gust kmh
-					if (w.windgust==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.windgust);
-					break;
+int ws_export_log(FILE *fp,uint32_t address,uint8_t *data,uint32_t size)
+{
+	return ws_dump(address,data,size,16);
+}
 
-				case 'g': // wind gust mph
-					if (w.windgust==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,kmh2mph(w.windgust));
-					break;
+int ws_export_bin(FILE *fp,uint32_t address,uint8_t *data,uint32_t size)
+{
+	return fwrite(data,1,size,fp)!=size;
+}
 
-				case 'D': // wind direction - named
-					strcatenc(out,w.winddir,urlencode);
-					break;
+// Lines "D6C0 05 38 EE ...", built with a digit table instead of printf per byte
 
-				case 'd': // wind direction - degrees
-					if (w.winddeg==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%d",out,w.winddeg);
-					break;
+int ws_export_hex(FILE *fp,uint32_t address,uint8_t *data,uint32_t size)
+{
+	static const char hex[]="0123456789ABCDEF";
+	char line[5+16*3+1],*p;
+	uint32_t i,j;
+
+	for (i=0;i<size;)
+	{	p=line;
+		*p++=hex[(address+i)>>12&15];
+		*p++=hex[(address+i)>>8&15];
+		*p++=hex[(address+i)>>4&15];
+		*p++=hex[(address+i)&15];
+		for (j=0;j<16 && i<size;i++,j++)
+		{	*p++=' ';
+			*p++=hex[data[i]>>4];
+			*p++=hex[data[i]&15];
+		}
+		*p++='\n';
+		if (fwrite(line,1,p-line,fp)!=p-line) return 1;
+	}
+	return 0;
+}
 
-				case 'P': // abs. pressure hPa
-					if (w.pressabs<900 || w.pressabs>1100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.pressabs);
-					break;
+// Uncalibrated values of each record (temperatures C, pressure hPa, wind km/h, rain mm), decoded by ws_decode()
 
-				case 'p': // abs. pressure in
-					if (w.pressabs<900 || w.pressabs>1100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.2f",out,hpa2in(w.pressabs));
-					break;
+int ws_export_rec(FILE *fp,uint32_t address,uint8_t *data,uint32_t size)
+{
+	static struct calib none={1,0,1,0,1,0,1,0,1,0,1,0,1,0,1,0,0,1,0,1,0};
+	static struct wrecord recs[WS_READ_CHUNK/0x10];
+	struct wcontext ctx={&none,0,0,ws_entry_size};
+	struct wrecord *r;
+	uint8_t *b;
+	int i,n;
+
+	n=size/ws_entry_size;
+	ws_decode(&ctx,data,n,recs);
+	for (i=0;i<n;i++)
+	{	b=data+i*ws_entry_size;
+		r=&recs[i];
+		fprintf(fp,"0x%04X\t%d\t%d\t%.1f\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%u\t%.1f\t0x%02X",
+			address+i*ws_entry_size,r->age,r->humin,r->tempin,r->humout,r->tempout,
+			r->pressabs,r->windspeed,r->windgust,b[0x0C],r->rain,b[0x0F]);
+		if (ws_entry_size==0x14)
+			fprintf(fp,"\t%.1f\t%d",r->illu,r->uv);
+		if (fputc('\n',fp)==EOF) return 1;
+	}
+	return 0;
+}
 
-				case 'L': // rel. pressure hPa
-					if (w.pressrel<900 || w.pressrel>1100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.pressrel);
-					break;
+// Give stdout a large buffer once, before anything is written to it
 
-				case 'l': // rel. pressure in
-					if (w.pressrel<900 || w.pressrel>1100)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.2f",out,hpa2in(w.pressrel));
-					break;
+void ws_stdout_buffer(void)
+{
+	static char *sbuf=NULL;
 
-				case 'm': // illumination in W/m²
-					if (w.illu==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.2f",out,lux2wattm2(w.illu));
-					break;
+	if (sbuf==NULL)
+	{	sbuf=malloc(WS_EXPORT_BUFFER);
+		if (sbuf) setvbuf(stdout,sbuf,_IOFBF,WS_EXPORT_BUFFER);
+	}
+}
 
-				case 'M': // illumination in lux
-					if (w.illu==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.illu);
-					break;
+// Decode the records of positions startpos..endpos in one batch, complete them from the time and rain
+// indexes like ws_parse() and write them in the bulk output format o, flushed once
 
-				case 'R': // rain total counter mm
-					if (w.rain==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.rain);
-					break;
+int ws_output(struct woutput *o,uint16_t address,int startpos,int endpos,time_t curtime,int last_age)
+{
+	static struct wrecord *recs=NULL;
+	static int size=0;
+	struct wcontext ctx={&c,altitude,read_period,ws_entry_size};
+	struct wrecord *r;
+	int i,n=endpos-startpos+1,rv;
+
+	if (n<=0) return 0;
+	if (n>size)
+	{	r=realloc(recs,n*sizeof(struct wrecord));
+		if (!r)
+		{	logger(LOG_ERROR,"ws_output","Could not allocate memory for %d records",n);
+			return 1;
+		}
+		recs=r;
+		size=n;
+	}
 
-				case 'r': // rain total counter in
-					if (w.rain==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.2f",out,mm2in(w.rain));
-					break;
+	ws_decode_ring(&ctx,img->mem,get_address(address,startpos),n,recs);
+	for (i=0;i<n;i++)
+	{	r=&recs[i];
+		r->datetime=ws_rec_time(startpos+i,curtime,last_age);
+		r->rainhour=ws_rain_last(&ws_rainidx,startpos+i,60);
+		r->rainday=ws_rain_since0h(&ws_rainidx,startpos+i);
+		if (r->rainhour<0 || r->rainhour>50)
+		{	r->rainhour=-1;
+			r->err|=WS_ERR_RAINHOUR;
+		}
+		if (r->rainday<0 || r->rainday>100)
+		{	r->rainday=-1;
+			r->err|=WS_ERR_RAINDAY;
+		}
+		if (r->err&WS_ERR_SENSOR) r->rainhour=r->rainday=-1;
+	}
 
-				case 'S': // rain 60 min mm
-					if (w.rainhour==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.rainhour);
-					break;
+	rv=o->write(ws_out_fp,recs,n);
+	if (fflush(ws_out_fp)!=0) rv=1;
+	if (rv!=0) logger(LOG_ERROR,"ws_output","Could not write %d records as %s",n,o->name);
+	else logger(LOG_DEBUG,"ws_output","Wrote %d records as %s",n,o->name);
+	return rv;
+}
 
-				case 's': // rain 60 min in
-					if (w.rainhour==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.2f",out,mm2in(w.rainhour));
-					break;
+// Append value of column col of record r as text, numbers are formatted without printf
 
-				case 'T': // rain from 0h mm
-					if (w.rainday==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.1f",out,w.rainday);
-					break;
+char *ws_output_value(char *p,struct wcolumn *col,struct wrecord *r)
+{
+	char *v=(char *)r+col->offset;
 
-				case 't': // rain from 0h in
-					if (w.rainday==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%0.2f",out,mm2in(w.rainday));
-					break;
-
-				case 'N': // datetime local
-					strftime(buf,sizeof(buf),"%Y-%m-%d %H:%M:%S",localtime(&w.datetime));
-					strcatenc(out,buf,urlencode);
-					break;
-
-				case 'n': // datetime UTC
-					strftime(buf,sizeof(buf),"%Y-%m-%d %H:%M:%S",gmtime(&w.datetime));
-					strcatenc(out,buf,urlencode);
-					break;
-
-				case 'U': // UV
-					if (w.uv==-1)
-						strcatenc(out,error,urlencode);
-					else
-						sprintf(out,"%s%d",out,w.uv);
-					break;
-
-				case 'Y': // date DD.MM.YYYY local
-					strftime(buf,sizeof(buf),"%d.%m.%Y",localtime(&w.datetime));
-					strcatenc(out,buf,urlencode);
-					break;
-
-				case 'y': // datetime YYYYMMDDhhmm local
-					strftime(buf,sizeof(buf),"%Y%m%d%H%M",localtime(&w.datetime));
-					strcatenc(out,buf,urlencode);
-					break;
-
-				case 'Z': // time HH:MM local
-					strftime(buf,sizeof(buf),"%H:%M",localtime(&w.datetime));
-					strcatenc(out,buf,0); // Force no encoding for :
-					break;
-
-				case 'a': // age
-					sprintf(out,"%s%d",out,w.age);
-					break;
-
-				case 'K': // ws type
-					strcatenc(out,ws_type,urlencode);
-					break;
-
-				case 'x': // username
-					strcatenc(out,user,urlencode);
-					break;
-
-				case 'X': // password
-					strcatenc(out,pass,urlencode);
-					break;
-
-				case '%': // percents
-					strcatenc(out,"%",0);
-					break;
-			}
+	switch (col->type)
+	{	case WF_TIME: return p+ws_itoa(p,*(time_t *)v);
+		case WF_FLOAT: return p+ws_ftoa(p,*(float *)v,col->dec);
+		case WF_SHORT: return p+ws_itoa(p,*(short *)v);
+		case WF_TEXT: return p+sprintf(p,"%s",v);
+	}
+	return p;
+}
+
+int ws_output_csv(FILE *fp,struct wrecord *r,int n)
+{
+	char line[1024],*p;
+	int i,j;
+
+	for (i=0;i<n;i++,r++)
+	{	p=line;
+		for (j=0;j<sizeof(wcolumn)/sizeof(wcolumn[0]);j++)
+		{	if (j) *p++=',';
+			p=ws_output_value(p,&wcolumn[j],r);
 		}
-		else if (*format=='\\')
-		{
-			switch (*++format)
-			{
-				case 'n':
-					strcatenc(out,"\n",urlencode);
-					break;
+		*p++='\n';
+		if (fwrite(line,1,p-line,fp)!=p-line) return 1;
+	}
+	return 0;
+}
 
-				case 'r':
-					strcatenc(out,"\r",urlencode);
-					break;
+int ws_output_json(FILE *fp,struct wrecord *r,int n)
+{
+	char line[2048],*p;
+	int i,j;
+
+	for (i=0;i<n;i++,r++)
+	{	p=line;
+		for (j=0;j<sizeof(wcolumn)/sizeof(wcolumn[0]);j++)
+		{	p+=sprintf(p,"%s\"%s\":",j?",":"{",wcolumn[j].name);
+			if (wcolumn[j].type==WF_TEXT) *p++='"';
+			p=ws_output_value(p,&wcolumn[j],r);
+			if (wcolumn[j].type==WF_TEXT) *p++='"';
+		}
+		*p++='}';
+		*p++='\n';
+		if (fwrite(line,1,p-line,fp)!=p-line) return 1;
+	}
+	return 0;
+}
 
-				case 't':
-					strcatenc(out,"\t",urlencode);
-					break;
+// Fixed size records in the column order, the byte order is little endian on every host
 
+int ws_output_bin(FILE *fp,struct wrecord *r,int n)
+{
+	uint8_t rec[128],*p;
+	uint64_t x;
+	uint32_t f;
+	int i,j,k,l;
+
+	for (i=0;i<n;i++,r++)
+	{	p=rec;
+		for (j=0;j<sizeof(wcolumn)/sizeof(wcolumn[0]);j++)
+		{	char *v=(char *)r+wcolumn[j].offset;
+
+			switch (wcolumn[j].type)
+			{	case WF_TIME: x=(int64_t)*(time_t *)v; l=8; break;
+				case WF_FLOAT: memcpy(&f,v,4); x=f; l=4; break;
+				case WF_SHORT: x=(uint16_t)*(short *)v; l=2; break;
+				default: l=0;
 			}
+			for (k=0;k<l;k++) *p++=x>>(8*k);
 		}
-		else
-		{
-			char minibuf[2];
-			sprintf(minibuf,"%c",*format);
-			strcatenc(out,minibuf,0);
-		}
+		if (fwrite(rec,1,p-rec,fp)!=p-rec) return 1;
 	}
-
 	return 0;
 }
 
+// Update the write phase after a cycle. A record of age a minutes was started between a+1 and a minutes
+// before curtime, the earlier bound is taken so the first poll is never late
 
-int ws_dump(uint16_t address,uint8_t *data,uint16_t size,uint8_t w)
+void ws_sched_learn(uint16_t address,int last_age,time_t curtime)
 {
-	uint16_t i,j,s;
-	char *buf;
+	struct wsched *p=&ws_sched;
 
-	s=8+(w*5)+1;
-	logger(LOG_DEBUG,"ws_dump","Allocate %u bytes for temporary buffer",s);
-	buf=malloc(s);
-	if (!buf) logger(LOG_WARNING,"ws_dump","Could not allocate %u bytes for temporary buffer, verbose dump enabled",s);
+	if (address!=p->pointer || !p->observed)
+	{	p->pointer=address;
+		p->written=curtime-(last_age+1)*60;
+		p->observed=0;
+	}
+	p->next=p->written+read_period*60-WS_SCHED_POLL;
+	if (p->next<curtime) p->next=curtime+WS_SCHED_POLL;
 
-	logger(LOG_INFO,"ws_dump","Dump %u bytes from address 0x%04X",size,address);
-	for (i=0;i<size && buf && data;)
-	{
-		if (buf) sprintf(buf,"0x%04X:",address+i);
-		for (j=0;j<w && i<size;i++,j++)
-		{
-			if (buf)
-			{
-				sprintf(buf,"%s 0x%02X",buf,data[i]);
-			} else
-			{
-				logger(LOG_INFO,"ws_dump","0x%04X: 0x%02X",address+i,data[i]);
-			}
-		}
-		if (buf) logger(LOG_INFO,"ws_dump",buf);
+	logger(LOG_DEBUG,"ws_sched_learn","Record at 0x%04X started %s%d secs ago, next write expected in %d secs",
+		address,p->observed?"":"at most ",(int)(curtime-p->written),(int)(p->written+read_period*60-curtime));
+}
+
+// Read the 2 byte position pointer when a write is due, returns 1 if the station started a new record
+
+int ws_sched_poll(struct wsession *s)
+{
+	struct wsched *p=&ws_sched;
+	uint8_t b[2];
+	uint16_t pointer;
+	time_t now;
+
+	time(&now);
+	if (read_period==0 || now<p->next) return 0;
+
+	if (ws_session_read(s,WS_CURRENT_POSITION_ADDRESS,b,2)!=0)
+	{	p->next=now+60;
+		return 0;
 	}
+	pointer=b[0]+b[1]*256;
 
-	return 0;
+	if (pointer==p->pointer)
+	{	p->next=now+(now>p->written+read_period*60+WS_SCHED_LATE?60:WS_SCHED_POLL);
+		return 0;
+	}
+
+	logger(LOG_DEBUG,"ws_sched_poll","Station moved to 0x%04X, %d secs after the expected write",
+		pointer,(int)(now-p->written-read_period*60));
+	p->pointer=pointer;
+	p->written=now;
+	p->observed=1;
+	p->next=now+read_period*60-WS_SCHED_POLL;
+	return 1;
+}
+
+// Position of the record ~60 mins before curpos (if not existent take first available record)
+
+int ws_pos60(int curpos,int last_age,int data_count)
+{
+	int pos60 = curpos-round((float)(60-last_age)/read_period)-1;
+	if (0-pos60>=data_count) pos60=1-data_count;
+	return pos60;
+}
+
+// Position of the record from ~0h of the curpos' day (if not existent take first available record)
+// The calculation is not accurate when changing daylight saving time
+
+int ws_pos0h(int curpos,int last_age,int data_count,struct tm *tmptr)
+{
+	int pos0h = 0-round((float)(tmptr->tm_hour*60+tmptr->tm_min-last_age)/read_period)-1;
+	while (curpos<pos0h) pos0h -= round((float)60*24/read_period);
+	if (0-pos0h>=data_count) pos0h=1-data_count;
+	return pos0h;
 }
 
 // Get address for given base and position, correct circular buffer calculation
@@ -2108,7 +3940,7 @@ void signal_handler(int signal)
 	else		
 		logger(LOG_ERROR,"signal_handler","Unknown signal received, exiting...");
 
-	if (dev) ws_close(&dev);
+	ws_session_close(&wss);
 	exit(1);
 }
 
@@ -2118,9 +3950,10 @@ void signal_handler(int signal)
 
 void logger(log_event event,char *function,char *msg,...)
 {
-	va_list args;
+	va_list args,copy;
 
 	va_start(args,msg);
+	va_copy(copy,args);		// vfprintf() consumes args, the error URL formats msg a second time
 	switch (event)
 	{
 		case LOG_DEBUG:
@@ -2151,21 +3984,20 @@ void logger(log_event event,char *function,char *msg,...)
 // Send error message to frewe-server
 
 				if (frewe_server_url_error!=NULL)
-				{
-					char *last_error_text = malloc(strlen(msg)+500);
-					if (last_error_text) 
-					{	vsprintf(last_error_text,msg,args); 
-						char *server_url_error_full = malloc(strlen(frewe_server_url_error)+strlen(last_error_text)+100);
-						if (server_url_error_full)
-						{	strcpy(server_url_error_full,frewe_server_url_error);
-							strcat(server_url_error_full,"&errortext=");
-							strcatenc(server_url_error_full,last_error_text,1);
-							logger(LOG_DEBUG,"main","Submit error message to server URL: %s", server_url_error_full);
-							ws_submit(server_url_error_full,&filebuf);
-							free(server_url_error_full);
-						}
-						free(last_error_text);
+				{	struct wbuf text,url;
+
+					ws_buf_init(&text,strlen(msg)+100);
+					ws_buf_vprintf(&text,msg,copy);
+					ws_buf_init(&url,strlen(frewe_server_url_error)+text.len*3+16);
+					ws_buf_puts(&url,frewe_server_url_error);
+					ws_buf_puts(&url,"&errortext=");
+					if (!text.failed) ws_buf_putenc(&url,text.s,1);
+					if (!text.failed && ws_buf_done(&url))
+					{	logger(LOG_DEBUG,"main","Submit error message to server URL: %s", url.s);
+						ws_submit(url.s,NULL,0);
 					}
+					free(url.s);
+					free(text.s);
 				}
 			}
 			break;
@@ -2179,21 +4011,134 @@ void logger(log_event event,char *function,char *msg,...)
 			}
 			break;
 	}
+	va_end(copy);
 	va_end(args);
 }
 
-// Converts a hex character to its integer value
+// URL encoding classes of the characters: 1 unreserved (copied), 2 space (written as +), 0 written as %XX
+
+static const unsigned char urlclass[256]=
+{	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	2,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0,  1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,	// space - . 0-9
+	0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,  1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,	// A-Z _
+	0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,  1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0,	// a-z ~
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+// Values of the hex digits, -1 for other characters
+
+static const signed char urlhex[256]=
+{	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,  0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+	-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+#if defined(__SSE2__)
+
+// Bit mask of the unreserved characters A-Z a-z 0-9 - _ . ~ among 16 bytes, bytes >=0x80 compare negative
+
+static inline int ws_urlsafe16(__m128i x)
+{
+	__m128i m;
+
+	m=_mm_and_si128(_mm_cmpgt_epi8(x,_mm_set1_epi8('0'-1)),_mm_cmplt_epi8(x,_mm_set1_epi8('9'+1)));
+	m=_mm_or_si128(m,_mm_and_si128(_mm_cmpgt_epi8(x,_mm_set1_epi8('A'-1)),_mm_cmplt_epi8(x,_mm_set1_epi8('Z'+1))));
+	m=_mm_or_si128(m,_mm_and_si128(_mm_cmpgt_epi8(x,_mm_set1_epi8('a'-1)),_mm_cmplt_epi8(x,_mm_set1_epi8('z'+1))));
+	m=_mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('-')));
+	m=_mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('_')));
+	m=_mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('.')));
+	m=_mm_or_si128(m,_mm_cmpeq_epi8(x,_mm_set1_epi8('~')));
+	return _mm_movemask_epi8(m);
+}
+
+#endif
+
+// URL encode n bytes of in to out, which must have room for n*3+1 bytes, and return the encoded length
+// Runs of unreserved characters are copied 16 bytes at a time
 
-char from_hex(char ch) {
-  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+size_t ws_urlenc(char *out, const char *in, size_t n)
+{
+	static const char hex[]="0123456789abcdef";
+	const unsigned char *s=(const unsigned char *)in,*end=s+n;
+	char *p=out;
+
+	while (s<end)
+	{
+#if defined(__SSE2__)
+		if (end-s>=16)
+		{	__m128i x=_mm_loadu_si128((__m128i *)s);
+			int k,mask=ws_urlsafe16(x);
+
+			if (mask==0xFFFF)
+			{	_mm_storeu_si128((__m128i *)p,x);
+				s+=16;
+				p+=16;
+				continue;
+			}
+			k=__builtin_ctz(~mask);
+			memcpy(p,s,k);
+			s+=k;
+			p+=k;
+		}
+#endif
+		switch (urlclass[*s])
+		{	case 1: *p++=*s; break;
+			case 2: *p++='+'; break;
+			default: *p++='%'; *p++=hex[*s>>4]; *p++=hex[*s&15];
+		}
+		s++;
+	}
+	*p=0;
+	return p-out;
 }
 
-// Converts an integer value to its hex character
+// URL decode n bytes of in to out, out may be in itself, and return the decoded length
+// A % not followed by two hex digits is kept as it is
 
-char to_hex(char code) 
+size_t ws_urldec(char *out, const char *in, size_t n)
 {
-	static char hex[] = "0123456789abcdef";
-	return hex[code & 15];
+	const unsigned char *s=(const unsigned char *)in,*end=s+n;
+	char *p=out;
+
+	while (s<end)
+	{
+#if defined(__SSE2__)
+		if (end-s>=16)
+		{	__m128i x=_mm_loadu_si128((__m128i *)s);
+			int k,mask=_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x,_mm_set1_epi8('%')),_mm_cmpeq_epi8(x,_mm_set1_epi8('+'))));
+
+			if (!mask)
+			{	_mm_storeu_si128((__m128i *)p,x);
+				s+=16;
+				p+=16;
+				continue;
+			}
+			k=__builtin_ctz(mask);
+			memmove(p,s,k);
+			s+=k;
+			p+=k;
+		}
+#endif
+		if (*s=='+')
+			*p++=' ';
+		else if (*s=='%' && end-s>=3 && urlhex[s[1]]>=0 && urlhex[s[2]]>=0)
+		{	*p++=urlhex[s[1]]<<4|urlhex[s[2]];
+			s+=2;
+		}
+		else
+			*p++=*s;
+		s++;
+	}
+	*p=0;
+	return p-out;
 }
 
 // Returns a url-encoded version of str
@@ -2201,22 +4146,11 @@ char to_hex(char code)
 
 char* URLencode(char *str) 
 {
-	char *pstr = str, *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
-	if (buf!=NULL)
-	{
-        	while (*pstr)
-          	{
-            		if (isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' || *pstr == '~') 
-              			*pbuf++ = *pstr;
-            		else if (*pstr == ' ') 
-              			*pbuf++ = '+';
-            		else 
-              			*pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
-            		pstr++;
-          	}
-          	*pbuf = '\0';
-	}
-  	return buf;
+	size_t n=strlen(str);
+	char *buf=malloc(n*3+1);
+
+	if (buf!=NULL) ws_urlenc(buf,str,n);
+	return buf;
 }
 
 // Returns a url-decoded version of str 
@@ -2224,31 +4158,10 @@ char* URLencode(char *str)
 
 char* URLdecode(char *str)
 {
-	char *pstr = str, *buf = malloc(strlen(str) + 1), *pbuf = buf;
-	if (buf!=NULL)
-	{
-		while (*pstr) 
-		{
-			if (*pstr == '%') 
-			{
-      				if (pstr[1] && pstr[2]) 
-      				{
-        				*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-        				pstr += 2;
-      				}
-    			} 
-    			else if (*pstr == '+') 
-    			{ 
-      				*pbuf++ = ' ';
-    			} 
-    			else 
-    			{
-      				*pbuf++ = *pstr;
-    			}
-    			pstr++;
-  		}
-  		*pbuf = '\0';
-  	}
+	size_t n=strlen(str);
+	char *buf=malloc(n+1);
+
+	if (buf!=NULL) ws_urldec(buf,str,n);
 	return buf;
 }
 
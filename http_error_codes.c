@@ -31,7 +31,11 @@ char *http_errlist[] =
 	"Couldn't convert Content-Length to integer",	/* HF_CONTENTLEN	*/
 	"Network error (description unavailable)",		/* HF_HERROR		*/
 	"Status code of %d but no Location: field",		/* HF_CANTREDIRECT  */
-	"Followed the maximum number of redirects (%d)" /* HF_MAXREDIRECTS  */
+	"Followed the maximum number of redirects (%d)",/* HF_MAXREDIRECTS  */
+	"Connection closed by the server",				/* HF_CONNCLOSED	*/
+	"Couldn't parse chunked transfer coding",		/* HF_CHUNKED		*/
+	"Metadata longer than %d bytes",				/* HF_HEADTOOLONG	*/
+	"Download stopped by the caller"				/* HF_CALLBACK		*/
 	};
 
 	/* Used to copy in messages from http_errlist[] and replace %d's with
@@ -24,6 +24,7 @@
 #define FETCHER_ERROR	0
 #define ERRNO			1
 #define H_ERRNO			2
+#define GAI_ERRNO		3		/* getaddrinfo() error in errorInt */
 
 /* HTTP Fetcher error codes */
 #define HF_SUCCESS		0
@@ -38,5 +39,9 @@
 #define HF_HERROR		9
 #define HF_CANTREDIRECT 10
 #define HF_MAXREDIRECTS 11
+#define HF_CONNCLOSED	12
+#define HF_CHUNKED		13
+#define HF_HEADTOOLONG	14
+#define HF_CALLBACK		15
 
 #endif
@@ -29,8 +29,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <time.h>
 #include "http_fetcher.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 /* Globals */
 int timeout = DEFAULT_READ_TIMEOUT;
 char *userAgent = NULL;
@@ -44,27 +51,126 @@ static int errorSource = 0;
 static int http_errno = 0;
 static int errorInt = 0;			/* When the error message has a %d in it,
 									 *	this variable is inserted */
+static int keepAlive = DEFAULT_KEEPALIVE;	/* Seconds a pooled connection may idle */
+
+	/* Resolved addresses by host and port.  getaddrinfo() tells no TTL, so
+	 *	addresses are kept dnsTTL seconds and failures dnsFailTTL seconds */
+static struct
+	{
+	char host[HOST_BUF_SIZE];
+	char port[8];
+	struct sockaddr_storage addr;
+	socklen_t addrlen;			/* 0 for a failed lookup */
+	int error;					/* getaddrinfo() error of a failed lookup */
+	time_t expires;
+	} dnsCache[DNS_CACHE_SIZE];
+static int dnsTTL = DEFAULT_DNS_TTL;
+static int dnsFailTTL = DEFAULT_DNS_FAIL_TTL;
+
+	/* Persistent connections, one slot per socket kept open after a
+	 *	response whose length was known (Content-Length or chunked) */
+static struct
+	{
+	char host[HOST_BUF_SIZE];	/* host[:port] as given in the url */
+	int sock;					/* -1 if the slot is free */
+	time_t idle;				/* When the connection was returned */
+	} pool[POOL_SIZE];
+static int poolInit = 0;
 
 
 	/* 
 	 * Actually downloads the page, registering a hit (donation)
-	 *	If the fileBuf passed in is NULL, the url is downloaded and then
-	 *	freed; otherwise the necessary space is allocated for fileBuf.
+	 *	If the fileBuf passed in is NULL, the body is read and dropped
+	 *	without keeping it; otherwise the necessary space is allocated
+	 *	for fileBuf.
 	 *	Returns size of download on success, -1 on error is set, 
 	 */
-int http_fetch(const char *url_tmp, char **fileBuf)
+int http_fetch(const char *url, char **fileBuf)
 	{
-	fd_set rfds;
-	struct timeval tv;
+	struct _http_sink sink;
+	int ret;
+
+	_http_sink_init(&sink, fileBuf != NULL ? SINK_ALLOC : SINK_DISCARD, NULL, 0);
+	ret = _http_fetch(url, &sink);
+	if(ret >= 0 && fileBuf != NULL)
+		*fileBuf = sink.buf;
+	return ret;
+	}
+
+
+
+	/*
+	 * Downloads the page into the caller's buffer, the rest is dropped.
+	 *	Returns the bytes kept on success, -1 on error
+	 */
+int http_fetch_buf(const char *url, char *buf, int size)
+	{
+	struct _http_sink sink;
+
+	if(buf == NULL || size < 1)
+		{
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_METAERROR;
+		return -1;
+		}
+	buf[0] = '\0';
+	_http_sink_init(&sink, SINK_FIXED, buf, size);
+	return _http_fetch(url, &sink);
+	}
+
+
+
+	/*
+	 * Downloads the page handing each part to cb as it arrives.
+	 *	Returns size of download on success, -1 on error
+	 */
+int http_fetch_cb(const char *url, http_body_cb cb, void *arg)
+	{
+	struct _http_sink sink;
+
+	_http_sink_init(&sink, SINK_CALLBACK, NULL, 0);
+	sink.cb = cb;
+	sink.arg = arg;
+	return _http_fetch(url, &sink);
+	}
+
+
+
+	/*
+	 * Downloads the page into the sink, on error an allocated body is
+	 *	freed.  Returns what _http_sink_done() tells, -1 on error
+	 */
+int _http_fetch(const char *url_tmp, struct _http_sink *sink)
+	{
+	int ret = _http_fetch_sink(url_tmp, sink);
+
+	if(ret < 0)
+		_http_sink_free(sink);
+	return ret;
+	}
+
+
+
+	/*
+	 * The request and response of _http_fetch()
+	 */
+int _http_fetch_sink(const char *url_tmp, struct _http_sink *sink)
+	{
+	struct _http_reader rd;
 	char headerBuf[HEADER_BUF_SIZE];
-	char *tmp, *url, *pageBuf, *requestBuf = NULL, *host, *charIndex;
-	int sock, bytesRead = 0, contentLength = -1, bufsize = REQUEST_BUF_SIZE;
+	char *url, *requestBuf = NULL, *host, *charIndex;
+	char poolHost[HOST_BUF_SIZE];
+	int sock, contentLength = -1;
 	int i,
 		ret = -1,
-		tempSize,
-		selectRet,
 		found = 0,	/* For redirects */
-		redirectsFollowed = 0;
+		redirectsFollowed = 0,
+		attempt,
+		retry,
+		reused,
+		status,
+		chunked,
+		reuse;		/* Connection can go back to the pool */
 
 
 	if(url_tmp == NULL)
@@ -106,179 +212,60 @@ int http_fetch(const char *url_tmp, char **fileBuf)
 			}
 
 		/* Compose a request string */
-		requestBuf = malloc(bufsize);
+		requestBuf = _http_request(host, charIndex);
 		if(requestBuf == NULL)
 			{
 			free(url);
-			errorSource = ERRNO;
-			return -1;
-			}
-		requestBuf[0] = 0;
-
-		if(charIndex == NULL)
-			{
-			/* The url has no '/' in it, assume the user is making a root-level
-			 *	request */ 
-			tempSize = strlen("GET /") + strlen(HTTP_VERSION) + 2;
-			if(_checkBufSize(&requestBuf, &bufsize, tempSize) ||
-				snprintf(requestBuf, bufsize, "GET / %s\r\n", HTTP_VERSION) < 0)
-				{
-				free(url);
-				free(requestBuf);
-				errorSource = ERRNO;
-				return -1;
-				}
-			}
-		else
-			{
-			tempSize = strlen("GET ") + strlen(charIndex) +
-  	          strlen(HTTP_VERSION) + 4;
-		 	/* + 4 is for ' ', '\r', '\n', and NULL */
-                                    
-			if(_checkBufSize(&requestBuf, &bufsize, tempSize) ||
-					snprintf(requestBuf, bufsize, "GET %s %s\r\n",
-					charIndex, HTTP_VERSION) < 0)
-				{
-				free(url);
-				free(requestBuf);
-				errorSource = ERRNO;
-				return -1;
-				}
+			return -1;		/* errorSource set within */
 			}
 
 		/* Null out the end of the hostname if need be */
 		if(charIndex != NULL)
 			*charIndex = 0;
 
-		/* Use Host: even though 1.0 doesn't specify it.  Some servers
-		 *	won't play nice if we don't send Host, and it shouldn't
-		 *	hurt anything */
-		ret = bufsize - strlen(requestBuf); /* Space left in buffer */
-		tempSize = (int)strlen("Host: ") + (int)strlen(host) + 3;
-        /* +3 for "\r\n\0" */
-		if(_checkBufSize(&requestBuf, &bufsize, tempSize + 128))
-			{
-			free(url);
-			free(requestBuf);
-			errorSource = ERRNO;
-			return -1;
-			}
-		strcat(requestBuf, "Host: ");
-		strcat(requestBuf, host);
-		strcat(requestBuf, "\r\n");
+		/* Keep host[:port] for the pool, makeSocket() cuts off the port */
+		strncpy(poolHost, host, HOST_BUF_SIZE - 1);
+		poolHost[HOST_BUF_SIZE - 1] = '\0';
 
-		if(!hideReferer && referer != NULL)	/* NO default referer */
+		/* A pooled connection may have been closed by the server in the
+		 *	meantime without us noticing, so the request is sent once more
+		 *	on a new connection if nothing comes back on a reused one.  Only
+		 *	an end of file or a reset before the first byte counts, after a
+		 *	timeout the server may still process the request. */
+		for(attempt = 0; ; attempt++)
 			{
-			tempSize = (int)strlen("Referer: ") + (int)strlen(referer) + 3;
-   	        /* + 3 is for '\r', '\n', and NULL */
-			if(_checkBufSize(&requestBuf, &bufsize, tempSize))
-				{
-				free(url);
-				free(requestBuf);
-				errorSource = ERRNO;
-				return -1;
-				}
-			strcat(requestBuf, "Referer: ");
-			strcat(requestBuf, referer);
-			strcat(requestBuf, "\r\n");
-			}
+			sock = _http_pool_get(poolHost, &reused);	/* errorSource set within */
+			if(sock == -1) { free(url); free(requestBuf); return -1;}
 
-		if(!hideUserAgent && userAgent == NULL)
-			{
-			tempSize = (int)strlen("User-Agent: ") +
-				(int)strlen(DEFAULT_USER_AGENT) + (int)strlen(VERSION) + 4;
-   	        /* + 4 is for '\', '\r', '\n', and NULL */
-			if(_checkBufSize(&requestBuf, &bufsize, tempSize))
-				{
-				free(url);
-				free(requestBuf);
-				errorSource = ERRNO;
-				return -1;
-				}
-			strcat(requestBuf, "User-Agent: ");
-			strcat(requestBuf, DEFAULT_USER_AGENT);
-			strcat(requestBuf, "/");
-			strcat(requestBuf, VERSION);
-			strcat(requestBuf, "\r\n");
-			}
-		else if(!hideUserAgent)
-			{
-			tempSize = (int)strlen("User-Agent: ") + (int)strlen(userAgent) + 3;
-   	        /* + 3 is for '\r', '\n', and NULL */
-			if(_checkBufSize(&requestBuf, &bufsize, tempSize))
+			rd.sock = sock;
+			rd.pos = rd.len = rd.received = 0;
+			ret = _http_write(sock, requestBuf, strlen(requestBuf));
+			if(ret == 0)
 				{
-				free(url);
-				free(requestBuf);
-				errorSource = ERRNO;
-				return -1;
+				/* Grab enough of the response to get the metadata, the rest
+				 *	of the block read stays in rd for the body */
+				ret = _http_read_header(&rd, headerBuf);	/* errorSource set within */
 				}
-			strcat(requestBuf, "User-Agent: ");
-			strcat(requestBuf, userAgent);
-			strcat(requestBuf, "\r\n");
-			}
-
-		tempSize = (int)strlen("Connection: Close\r\n\r\n");
-		if(_checkBufSize(&requestBuf, &bufsize, tempSize))
-			{
-			free(url);
-			free(requestBuf);
-			errorSource = ERRNO;
-			return -1;
-			}
-		strcat(requestBuf, "Connection: Close\r\n\r\n");
-
-		/* Now free any excess memory allocated to the buffer */
-		tmp = realloc(requestBuf, strlen(requestBuf) + 1);
-		if(tmp == NULL)
-			{
-			free(url);
-			free(requestBuf);
-			errorSource = ERRNO;
-			return -1;
+			if(ret >= 0)
+				break;
+			retry = reused && attempt == 0 && rd.received == 0 &&
+				((errorSource == FETCHER_ERROR && http_errno == HF_CONNCLOSED) ||
+				(errorSource == ERRNO && (errno == ECONNRESET || errno == EPIPE)));
+			close(sock);
+			if(!retry) { free(url); free(requestBuf); return -1; }
 			}
-		requestBuf = tmp;
-
-		sock = makeSocket(host);		/* errorSource set within makeSocket */
-		if(sock == -1) { free(url); free(requestBuf); return -1;}
 
 		free(url);
         url = NULL;
-
-		if(write(sock, requestBuf, strlen(requestBuf)) == -1)
-			{
-			close(sock);
-			free(requestBuf);
-			errorSource = ERRNO;
-			return -1;
-			}
-
 		free(requestBuf);
         requestBuf = NULL;
 
-		/* Grab enough of the response to get the metadata */
-		ret = _http_read_header(sock, headerBuf);	/* errorSource set within */
-		if(ret < 0) { close(sock); return -1; }
-
 		/* Get the return code */
-		charIndex = strstr(headerBuf, "HTTP/");
-		if(charIndex == NULL)
-			{
-			close(sock);
-			errorSource = FETCHER_ERROR;
-			http_errno = HF_FRETURNCODE;
-			return -1;
-			}
-		while(*charIndex != ' ')
-			charIndex++;
-		charIndex++;
-
-		ret = sscanf(charIndex, "%d", &i);
-		if(ret != 1)
+		i = status = _http_status(headerBuf);
+		if(i == -1)
 			{
 			close(sock);
-			errorSource = FETCHER_ERROR;
-			http_errno = HF_CRETURNCODE;
-			return -1;
+			return -1;		/* errorSource set within */
 			}
 		if(i<200 || i>307)
 			{
@@ -290,16 +277,14 @@ int http_fetch(const char *url_tmp, char **fileBuf)
 			}
 
 		/* If a redirect, repeat operation until final URL is found or we
-		 *  redirect followRedirects times.  Note the case sensitive "Location",
-		 *  should probably be made more robust in the future (without relying
-		 *  on the non-standard strcasecmp()).
+		 *  redirect followRedirects times.
 		 * This bit mostly by Dean Wilder, tweaked by me */
 		if(i >= 300)
 			{
 		    redirectsFollowed++;
 
 			/* Pick up redirect URL, allocate new url, and repeat process */
-			charIndex = strstr(headerBuf, "Location:");
+			charIndex = _http_header(headerBuf, "Location");
 			if(!charIndex)
 				{
 				close(sock);
@@ -308,10 +293,6 @@ int http_fetch(const char *url_tmp, char **fileBuf)
 				http_errno = HF_CANTREDIRECT;
 				return -1;
 				}
-			charIndex += strlen("Location:");
-            /* Skip any whitespace... */
-            while(*charIndex != '\0' && isspace(*charIndex))
-                charIndex++;
             if(*charIndex == '\0')
                 {
 				close(sock);
@@ -327,6 +308,7 @@ int http_fetch(const char *url_tmp, char **fileBuf)
 				url = (char *)malloc(i + 1);
 				strncpy(url, charIndex, i);
 				url[i] = '\0';
+				close(sock);	/* The redirect body is not read */
 				}
 			else
                 /* Found 'Location:' but contains no URL!  We'll handle it as
@@ -347,7 +329,7 @@ int http_fetch(const char *url_tmp, char **fileBuf)
     
     if(redirectsFollowed >= followRedirects && !found)
         {
-        close(sock);
+        /* The socket was closed when the redirect was found */
     	errorInt = followRedirects; /* To be inserted in error string */
     	errorSource = FETCHER_ERROR;
     	http_errno = HF_MAXREDIRECTS;
@@ -355,22 +337,29 @@ int http_fetch(const char *url_tmp, char **fileBuf)
         }
 	
 	/*
-	 * Parse out about how big the data segment is.
-	 *	Note that under current HTTP standards (1.1 and prior), the
-	 *	Content-Length field is not guaranteed to be accurate or even present. 
-	 *	I just use it here so I can allocate a ballpark amount of memory.
+	 * Work out how the body is framed.  Only with a known length (chunked
+	 *	or Content-Length) the end of the body is found without the server
+	 *	closing the connection, so only then the connection can be reused.
+	 *	HTTP/1.0 servers close unless they answer with keep-alive.
 	 *
 	 * Note that some servers use different capitalization
 	 */
-	charIndex = strstr(headerBuf, "Content-Length:");
-	if(charIndex == NULL)
-		charIndex = strstr(headerBuf, "Content-length:");
-
-	if(charIndex != NULL)
+	reuse = keepAlive > 0;
+	charIndex = _http_header(headerBuf, "Connection");
+	if(charIndex != NULL && strncasecmp(charIndex, "close", 5) == 0)
+		reuse = 0;
+	if(strncmp(headerBuf, "HTTP/1.0", 8) == 0 &&
+			(charIndex == NULL || strncasecmp(charIndex, "keep-alive", 10) != 0))
+		reuse = 0;
+
+	charIndex = _http_header(headerBuf, "Transfer-Encoding");
+	chunked = charIndex != NULL && strncasecmp(charIndex, "chunked", 7) == 0;
+
+	charIndex = _http_header(headerBuf, "Content-Length");
+	if(charIndex != NULL && !chunked)
 		{
-		ret = sscanf(charIndex + strlen("content-length: "), "%d",
-			&contentLength);
-		if(ret < 1)
+		ret = sscanf(charIndex, "%d", &contentLength);
+		if(ret < 1 || contentLength < 0)
 			{
 			close(sock);
 			errorSource = FETCHER_ERROR;
@@ -378,106 +367,82 @@ int http_fetch(const char *url_tmp, char **fileBuf)
 			return -1;
 			}
 		}
-	
-	/* Allocate enough memory to hold the page */
-	if(contentLength == -1)
-		contentLength = DEFAULT_PAGE_BUF_SIZE;
+	if(status == 204 || status == 304)		/* Never have a body */
+		contentLength = 0;
 
-	pageBuf = (char *)malloc(contentLength);
-	if(pageBuf == NULL)
+	if(chunked)
+		ret = _http_read_chunked(&rd, sink);	/* errorSource set within */
+	else if(contentLength >= 0)
+		{
+		/* Room for the whole body at once */
+		ret = _http_sink_reserve(sink, contentLength);
+		if(ret == 0)
+			ret = _http_read_body(&rd, sink, contentLength);
+		}
+	else
+		{
+		/* No length given, the body ends when the server closes */
+		reuse = 0;
+		ret = _http_read_close(&rd, sink);	/* errorSource set within */
+		}
+	if(ret < 0)
 		{
 		close(sock);
-		errorSource = ERRNO;
 		return -1;
 		}
 
-	/* Begin reading the body of the file */
-	while(ret > 0)
-		{
-		FD_ZERO(&rfds);
-		FD_SET(sock, &rfds);
-		tv.tv_sec = timeout; 
-		tv.tv_usec = 0;
-
-		if(timeout >= 0)
-			selectRet = select(sock+1, &rfds, NULL, NULL, &tv);
-		else		/* No timeout, can block indefinately */
-			selectRet = select(sock+1, &rfds, NULL, NULL, NULL);
-
-		if(selectRet == 0)
-			{
-			errorSource = FETCHER_ERROR;
-			http_errno = HF_DATATIMEOUT;
-			errorInt = timeout;
-			close(sock);
-			free(pageBuf);
-			return -1;
-			}
-		else if(selectRet == -1)
-			{
-			close(sock);
-			free(pageBuf);
-			errorSource = ERRNO;
-			return -1;
-			}
+	if(rd.pos != rd.len)
+		reuse = 0;		/* More than the response arrived, don't trust it */
+	if(reuse)
+		_http_pool_put(poolHost, sock);
+	else
+		close(sock);
+	return _http_sink_done(sink);
+	}
 
-		ret = read(sock, pageBuf + bytesRead, contentLength);
-		if(ret == -1)
-			{
-			close(sock);
-			free(pageBuf);
-			errorSource = ERRNO;
-			return -1;
-			}
 
-		bytesRead += ret;
 
-		if(ret > 0)
-			{
-			/* To be tolerant of inaccurate Content-Length fields, we'll
-			 *	allocate another read-sized chunk to make sure we have
-			 *	enough room.
-			 */
-			tmp = (char *)realloc(pageBuf, bytesRead + contentLength);
-			if(tmp == NULL)
-				{
-				close(sock);
-				free(pageBuf);
-				errorSource = ERRNO;
-				return -1;
-				}
-            pageBuf = tmp;
-			}
-		}
-	
 	/*
-	 * The download buffer is too large.  Trim off the safety padding.
-     * Note that we add one NULL byte to the end of the data, as it may not
-     *  already be NULL terminated and we can't be sure what type of data it
-     *  is or what the caller will do with it.
+	 * Composes the GET request for host (up to path or its end) and path
+	 *	into a new buffer.  Use Host: even though 1.0 doesn't specify it.
+	 *	Some servers won't play nice if we don't send Host, and it
+	 *	shouldn't hurt anything.
 	 */
-	tmp = (char *)realloc(pageBuf, bytesRead + 1);
-		/* tmp shouldn't be null, since we're _shrinking_ the buffer,
-		 *	and if it DID fail, we could go on with the too-large buffer,
-		 *	but something would DEFINATELY be wrong, so we'll just give
-		 *	an error message */
-	if(tmp == NULL)
+char *_http_request(const char *host, const char *path)
+	{
+	const char *agent = NULL, *ref = NULL;
+	char *requestBuf;
+	int hostLen, size;
+
+	hostLen = path != NULL ? (int)(path - host) : (int)strlen(host);
+	if(path == NULL)
+		path = "/";		/* The url has no '/' in it, assume root-level */
+
+	if(!hideReferer && referer != NULL)	/* NO default referer */
+		ref = referer;
+	if(!hideUserAgent && userAgent == NULL)
+		agent = DEFAULT_USER_AGENT "/" VERSION;
+	else if(!hideUserAgent)
+		agent = userAgent;
+
+	size = strlen("GET  \r\nHost: \r\nReferer: \r\nUser-Agent: \r\n"
+		"Connection: keep-alive\r\n\r\n") + strlen(path) +
+		strlen(HTTP_VERSION) + hostLen + (ref ? strlen(ref) : 0) +
+		(agent ? strlen(agent) : 0) + 1;
+	requestBuf = malloc(size);
+	if(requestBuf == NULL)
 		{
-		close(sock);
-		free(pageBuf);
 		errorSource = ERRNO;
-		return -1;
+		return NULL;
 		}
-    pageBuf = tmp;
-    pageBuf[bytesRead] = '\0';  /* NULL terminate the data */
-
-	if(fileBuf == NULL)	/* They just wanted us to "hit" the url */
-		free(pageBuf);
-	else
-		*fileBuf = pageBuf;
 
-	close(sock);
-	return bytesRead;
+	snprintf(requestBuf, size,
+		"GET %s %s\r\nHost: %.*s\r\n%s%s%s%s%s%sConnection: %s\r\n\r\n",
+		path, HTTP_VERSION, hostLen, host,
+		ref ? "Referer: " : "", ref ? ref : "", ref ? "\r\n" : "",
+		agent ? "User-Agent: " : "", agent ? agent : "", agent ? "\r\n" : "",
+		keepAlive > 0 ? "keep-alive" : "close");
+	return requestBuf;
 	}
 
 
@@ -550,6 +515,51 @@ void http_setTimeout(int seconds) { timeout = seconds; }
 
 
 
+	/*
+	 * Changes how long a connection is kept open for the next request to
+	 *	the same host.  0 disables keep-alive and closes pooled connections
+	 */
+void http_setKeepAlive(int seconds)
+	{
+	keepAlive = seconds;
+	if(keepAlive <= 0)
+		http_closeConnections();
+	}
+
+
+
+	/*
+	 * Changes how long resolved addresses and failed lookups are cached
+	 */
+void http_setResolverTTL(int seconds, int failSeconds)
+	{
+	int i;
+
+	dnsTTL = seconds;
+	dnsFailTTL = failSeconds;
+	for(i = 0; i < DNS_CACHE_SIZE; i++)
+		dnsCache[i].expires = 0;
+	}
+
+
+
+	/*
+	 * Closes all pooled connections
+	 */
+void http_closeConnections(void)
+	{
+	int i;
+
+	for(i = 0; poolInit && i < POOL_SIZE; i++)
+		if(pool[i].sock != -1)
+			{
+			close(pool[i].sock);
+			pool[i].sock = -1;
+			}
+	}
+
+
+
 	/*
 	 * Changes the number of HTTP redirects HTTP Fetcher will automatically
 	 *	follow.  If a request returns a status code of 3XX and contains
@@ -609,6 +619,8 @@ void http_perror(const char *string)
 		perror(string);
 	else if(errorSource == H_ERRNO)
 		herror(string);
+	else if(errorSource == GAI_ERRNO)
+		fprintf(stderr, "%s: %s\n", string, gai_strerror(errorInt));
 	else if(errorSource == FETCHER_ERROR)
 		{
 		char *stringIndex;
@@ -661,6 +673,8 @@ const char *http_strerror()
 #else
 		return http_errlist[HF_HERROR];
 #endif
+	else if(errorSource == GAI_ERRNO)
+		return gai_strerror(errorInt);
 	else if(errorSource == FETCHER_ERROR)
 		{
 		if(strstr(http_errlist[http_errno], "%d") == NULL)
@@ -689,66 +703,111 @@ const char *http_strerror()
 
 	
 	/*
-	 * Reads the metadata of an HTTP response.
-	 * Perhaps a little inefficient, as it reads 1 byte at a time, but
-	 *	I don't think it's that much of a loss (most headers aren't HUGE).
+	 * Reads the metadata of an HTTP response into headerPtr (at most
+	 *	HEADER_BUF_SIZE bytes with the NULL byte).  The socket is read in
+	 *	blocks, the end of the metadata is searched in memory and what
+	 *	follows it stays in rd for the body.  The empty line ending the
+	 *	metadata is cut off, CR are allowed before each LF.
 	 * Returns:
-	 *	# of bytes read on success, or
+	 *	# of bytes of metadata on success, or
 	 *	-1 on error
 	 */
-int _http_read_header(int sock, char *headerPtr)
+int _http_read_header(struct _http_reader *rd, char *headerPtr)
 	{
-	fd_set rfds;
-	struct timeval tv;
-	int bytesRead = 0, newlines = 0, ret, selectRet;
+	char *start, *eol;
+	int bytesRead = 0, lineStart = 0, n;
 
-	while(newlines != 2 && bytesRead != HEADER_BUF_SIZE)
+	for(;;)
 		{
-		FD_ZERO(&rfds);
-		FD_SET(sock, &rfds);
-		tv.tv_sec = timeout; 
-		tv.tv_usec = 0;
+		if(rd->pos == rd->len && _http_fill(rd, HF_HEADTIMEOUT) <= 0)
+			return -1;	/* errorSource set within */
 
-		if(timeout >= 0)
-			selectRet = select(sock+1, &rfds, NULL, NULL, &tv);
-		else		/* No timeout, can block indefinately */
-			selectRet = select(sock+1, &rfds, NULL, NULL, NULL);
-		
-		if(selectRet == 0)
+		start = rd->buf + rd->pos;
+		eol = memchr(start, '\n', rd->len - rd->pos);
+		n = eol != NULL ? eol + 1 - start : rd->len - rd->pos;
+		if(bytesRead + n >= HEADER_BUF_SIZE)
 			{
 			errorSource = FETCHER_ERROR;
-			http_errno = HF_HEADTIMEOUT;
-			errorInt = timeout;
+			http_errno = HF_HEADTOOLONG;
+			errorInt = HEADER_BUF_SIZE;
 			return -1;
 			}
-		else if(selectRet == -1) { errorSource = ERRNO; return -1; }
-
-		ret = read(sock, headerPtr, 1);
-		if(ret == -1) { errorSource = ERRNO; return -1; }
-		bytesRead++;
+		memcpy(headerPtr + bytesRead, start, n);
+		rd->pos += n;
+		bytesRead += n;
+		if(eol == NULL)
+			continue;
 
-		if(*headerPtr == '\r')			/* Ignore CR */
+		/* An empty line (LF or CRLF only) ends the metadata */
+		n = bytesRead - lineStart;
+		if(lineStart > 0 && (n == 1 || (n == 2 && headerPtr[lineStart] == '\r')))
 			{
-			/* Basically do nothing special, just don't set newlines
-			 *	to 0 */
-			headerPtr++;
-			continue;
+			bytesRead = lineStart;
+			break;
 			}
-		else if(*headerPtr == '\n')		/* LF is the separator */
-			newlines++;
-		else
-			newlines = 0;
-
-		headerPtr++;
+		lineStart = bytesRead;
 		}
 
-	headerPtr -= 3;		/* Snip the trailing LF's */
-	*headerPtr = '\0';
+	/* Snip the trailing line ends */
+	while(bytesRead > 0 && (headerPtr[bytesRead - 1] == '\n' ||
+			headerPtr[bytesRead - 1] == '\r'))
+		bytesRead--;
+	headerPtr[bytesRead] = '\0';
 	return bytesRead;
 	}
 
 
 
+	/*
+	 * Refills the read buffer of an empty reader with what the socket has,
+	 *	waiting at most timeout seconds.  timeoutError is the error code
+	 *	in case of a timeout.
+	 * Returns:
+	 *	# of bytes read,
+	 *	0 at the end of the connection (with the error set), or
+	 *	-1 on error
+	 */
+int _http_fill(struct _http_reader *rd, int timeoutError)
+	{
+	fd_set rfds;
+	struct timeval tv;
+	int ret, selectRet;
+
+	FD_ZERO(&rfds);
+	FD_SET(rd->sock, &rfds);
+	tv.tv_sec = timeout; 
+	tv.tv_usec = 0;
+
+	if(timeout >= 0)
+		selectRet = select(rd->sock+1, &rfds, NULL, NULL, &tv);
+	else		/* No timeout, can block indefinately */
+		selectRet = select(rd->sock+1, &rfds, NULL, NULL, NULL);
+	
+	if(selectRet == 0)
+		{
+		errorSource = FETCHER_ERROR;
+		http_errno = timeoutError;
+		errorInt = timeout;
+		return -1;
+		}
+	else if(selectRet == -1) { errorSource = ERRNO; return -1; }
+
+	rd->pos = rd->len = 0;
+	ret = read(rd->sock, rd->buf, sizeof(rd->buf));
+	if(ret == -1) { errorSource = ERRNO; return -1; }
+	if(ret == 0)
+		{
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_CONNCLOSED;
+		return 0;
+		}
+	rd->len = ret;
+	rd->received += ret;
+	return ret;
+	}
+
+
+
 	/*
 	 * Opens a TCP socket and returns the descriptor
 	 * Returns:
@@ -756,6 +815,20 @@ int _http_read_header(int sock, char *headerPtr)
 	 *	-1 on error
 	 */
 int makeSocket(const char *host)
+	{
+	return _http_connect(host, 0);
+	}
+
+
+
+	/*
+	 * Opens a TCP socket, with nonblocking set the socket is returned
+	 *	while the connect is still in progress
+	 * Returns:
+	 *	socket descriptor, or
+	 *	-1 on error
+	 */
+int _http_connect(const char *host, int nonblocking)
 	{
 	int sock;										/* Socket descriptor */
 	struct sockaddr_in sa;							/* Socket address */
@@ -793,22 +866,30 @@ int makeSocket(const char *host)
 */
 
 // NEW CODE BEGIN
-	struct addrinfo hints, *res;
-	
-	memset(&hints, 0, sizeof(hints));
- 	hints.ai_socktype = SOCK_STREAM;
- 	hints.ai_family = AF_INET;
-	
-	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) 
-	{ 	errorSource = H_ERRNO; 
-		return -1; 
-	}
-	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	/* The address comes from the resolver cache if possible */
+	if(_http_resolve(host, port, &addr, &addrlen) == -1)
+		return -1;		/* errorSource set within */
+
+	sock = socket(addr.ss_family, SOCK_STREAM, 0);
 	if(sock == -1) { errorSource = ERRNO; return -1; }
+	if(nonblocking && fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+		{
+		errorSource = ERRNO;
+		close(sock);
+		return -1;
+		}
 
-	ret = connect(sock, res->ai_addr, res->ai_addrlen);
-	if(ret == -1) { errorSource = ERRNO; return -1; }
-	freeaddrinfo(res);
+	ret = connect(sock, (struct sockaddr *)&addr, addrlen);
+	if(ret == -1 && !(nonblocking && errno == EINPROGRESS))
+		{
+		errorSource = ERRNO;
+		close(sock);
+		_http_resolve_forget(host, port);	/* The host may have moved */
+		return -1;
+		}
 	
 // NEW CODE END
 
@@ -838,3 +919,1214 @@ int _checkBufSize(char **buf, int *bufsize, int more)
 	*bufsize += more + 1;
 	return 0;
 	}
+
+
+
+	/*
+	 * Returns a connected socket for host[:port], a pooled one if there is
+	 *	a healthy one.  A pooled connection is dropped when it idled longer
+	 *	than the keep-alive time, or when it is readable: an idle HTTP
+	 *	connection only gets readable when the server closed it (or sent
+	 *	garbage), either way it can't be used.
+	 * Returns:
+	 *	socket descriptor, or
+	 *	-1 on error
+	 */
+int _http_pool_get(const char *host, int *reused)
+	{
+	char hostBuf[HOST_BUF_SIZE];
+	int sock;
+
+	sock = _http_pool_take(host);
+	*reused = sock != -1;
+	if(sock != -1)
+		return sock;
+
+	strcpy(hostBuf, host);
+	return makeSocket(hostBuf);		/* errorSource set within makeSocket */
+	}
+
+
+
+	/*
+	 * Takes a healthy pooled connection to host[:port] out of the pool,
+	 *	connections idle too long or closed by the server are dropped
+	 * Returns:
+	 *	socket descriptor, or
+	 *	-1 if there is none
+	 */
+int _http_pool_take(const char *host)
+	{
+	fd_set rfds;
+	struct timeval tv;
+	time_t now = time(NULL);
+	int i, sock;
+
+	if(!poolInit)
+		{
+		for(i = 0; i < POOL_SIZE; i++)
+			pool[i].sock = -1;
+		poolInit = 1;
+		}
+
+	for(i = 0; i < POOL_SIZE; i++)
+		{
+		if(pool[i].sock == -1 || strcmp(pool[i].host, host) != 0)
+			continue;
+
+		sock = pool[i].sock;
+		pool[i].sock = -1;
+		if(now - pool[i].idle > keepAlive)
+			{
+			close(sock);
+			continue;
+			}
+
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		if(select(sock+1, &rfds, NULL, NULL, &tv) != 0)
+			{
+			close(sock);
+			continue;
+			}
+
+		return sock;
+		}
+	return -1;
+	}
+
+
+
+	/*
+	 * Puts a connection with a completely read response back into the pool,
+	 *	replacing the connection idle for the longest time if it is full
+	 */
+void _http_pool_put(const char *host, int sock)
+	{
+	int i, slot = 0;
+
+	for(i = 0; i < POOL_SIZE; i++)
+		{
+		if(pool[i].sock == -1)
+			{
+			slot = i;
+			break;
+			}
+		if(pool[i].idle < pool[slot].idle)
+			slot = i;
+		}
+
+	if(pool[slot].sock != -1)
+		close(pool[slot].sock);
+	strcpy(pool[slot].host, host);
+	pool[slot].sock = sock;
+	pool[slot].idle = time(NULL);
+	}
+
+
+
+	/*
+	 * Writes the whole buffer.  send() with MSG_NOSIGNAL, so a connection
+	 *	closed by the server gives an error instead of SIGPIPE.
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_write(int sock, const char *buf, int len)
+	{
+	int ret;
+
+	while(len > 0)
+		{
+		ret = send(sock, buf, len, MSG_NOSIGNAL);
+		if(ret == -1)
+			{
+			if(errno == EINTR)
+				continue;
+			errorSource = ERRNO;
+			return -1;
+			}
+		buf += ret;
+		len -= ret;
+		}
+	return 0;
+	}
+
+
+
+	/*
+	 * Passes exactly len body bytes to the sink, first what is buffered in
+	 *	rd, then from the socket waiting at most timeout seconds for each
+	 *	block.
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_read_body(struct _http_reader *rd, struct _http_sink *sink, int len)
+	{
+	int n;
+
+	while(len > 0)
+		{
+		if(rd->pos == rd->len && _http_fill(rd, HF_DATATIMEOUT) <= 0)
+			return -1;	/* errorSource set within */
+		n = rd->len - rd->pos;
+		if(n > len)
+			n = len;
+		if(_http_sink_put(sink, rd->buf + rd->pos, n) < 0)
+			return -1;
+		rd->pos += n;
+		len -= n;
+		}
+	return 0;
+	}
+
+
+
+	/*
+	 * Reads a CRLF terminated line of at most size-1 characters, without
+	 *	the line end.  What follows the line stays in rd.
+	 * Returns:
+	 *	length of the line, or
+	 *	-1 on error
+	 */
+int _http_read_line(struct _http_reader *rd, char *line, int size)
+	{
+	char *start, *eol;
+	int len = 0, n;
+
+	for(;;)
+		{
+		if(rd->pos == rd->len && _http_fill(rd, HF_DATATIMEOUT) <= 0)
+			return -1;	/* errorSource set within */
+		start = rd->buf + rd->pos;
+		eol = memchr(start, '\n', rd->len - rd->pos);
+		n = eol != NULL ? eol - start : rd->len - rd->pos;
+		rd->pos += eol != NULL ? n + 1 : n;
+		if(n > size - 1 - len)
+			n = size - 1 - len;		/* Too long, the rest is skipped */
+		memcpy(line + len, start, n);
+		len += n;
+		if(eol != NULL)
+			break;
+		}
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+	line[len] = '\0';
+	return len;
+	}
+
+
+
+	/*
+	 * Passes a body with chunked transfer coding to the sink, chunk
+	 *	extensions and trailers are skipped.
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_read_chunked(struct _http_reader *rd, struct _http_sink *sink)
+	{
+	char line[HEADER_BUF_SIZE], *end;
+	long size;
+
+	for(;;)
+		{
+		if(_http_read_line(rd, line, sizeof(line)) < 0)
+			return -1;
+		size = strtol(line, &end, 16);
+		if(end == line || size < 0 || size > DEFAULT_PAGE_BUF_SIZE * 50)
+			{
+			errorSource = FETCHER_ERROR;
+			http_errno = HF_CHUNKED;
+			return -1;
+			}
+		if(size == 0)
+			break;
+
+		if(_http_read_body(rd, sink, size) < 0 ||
+				_http_read_line(rd, line, sizeof(line)) < 0)
+			return -1;
+		}
+
+	/* Skip the trailer up to the empty line */
+	do
+		{
+		size = _http_read_line(rd, line, sizeof(line));
+		if(size < 0)
+			return -1;
+		}
+	while(size > 0);
+	return 0;
+	}
+
+
+
+	/*
+	 * Gets the status code from the status line, leading blank lines are
+	 *	skipped and the protocol name is compared case insensitively
+	 * Returns:
+	 *	the status code, or
+	 *	-1 on error
+	 */
+int _http_status(const char *headers)
+	{
+	int status;
+
+	while(isspace((unsigned char)*headers))
+		headers++;
+	if(strncasecmp(headers, "HTTP/", 5) != 0)
+		{
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_FRETURNCODE;
+		return -1;
+		}
+	headers += strcspn(headers, " \t\r\n");
+	if((*headers != ' ' && *headers != '\t') ||
+			sscanf(headers, "%3d", &status) != 1 || status < 100)
+		{
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_CRETURNCODE;
+		return -1;
+		}
+	return status;
+	}
+
+
+
+	/*
+	 * Finds a header field in the response metadata, the name is compared
+	 *	case insensitively at the start of each line, blanks before the
+	 *	colon are tolerated.
+	 * Returns:
+	 *	pointer to the value after the colon and blanks, or
+	 *	NULL if the field is missing
+	 */
+char *_http_header(char *headers, const char *name)
+	{
+	char *line = headers, *value;
+	int len = strlen(name);
+
+	while(line != NULL && *line)
+		{
+		if(strncasecmp(line, name, len) == 0)
+			{
+			value = line + len;
+			while(*value == ' ' || *value == '\t')
+				value++;
+			if(*value == ':')
+				{
+				value++;
+				while(*value == ' ' || *value == '\t')
+					value++;
+				return value;
+				}
+			}
+		line = strchr(line, '\n');
+		if(line != NULL)
+			line++;
+		}
+	return NULL;
+	}
+
+
+
+	/*
+	 * Passes a body of unknown length up to the end of the connection to
+	 *	the sink.
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_read_close(struct _http_reader *rd, struct _http_sink *sink)
+	{
+	int ret;
+
+	for(;;)
+		{
+		/* What came along with the metadata first */
+		if(_http_sink_put(sink, rd->buf + rd->pos, rd->len - rd->pos) < 0)
+			return -1;
+		rd->pos = rd->len;
+
+		ret = _http_fill(rd, HF_DATATIMEOUT);
+		if(ret < 0)
+			return -1;	/* errorSource set within */
+		if(ret == 0)
+			return 0;
+		}
+	}
+
+
+
+	/*
+	 * Sets up a sink for a body: mode SINK_FIXED keeps at most size-1
+	 *	bytes in buf, SINK_ALLOC allocates the buffer and keeps at most
+	 *	size bytes (0 for all of the body)
+	 */
+void _http_sink_init(struct _http_sink *sink, int mode, char *buf, int size)
+	{
+	memset(sink, 0, sizeof(*sink));
+	sink->mode = mode;
+	if(mode == SINK_FIXED)
+		{
+		sink->buf = buf;
+		sink->size = size;
+		}
+	else
+		sink->max = size;
+	}
+
+
+
+	/*
+	 * Makes room for len more bytes in an allocated sink, up to its limit,
+	 *	so a body of known length is copied without growing the buffer
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_sink_reserve(struct _http_sink *sink, int len)
+	{
+	char *tmp;
+
+	if(sink->mode != SINK_ALLOC)
+		return 0;
+	if(sink->max > 0 && len > sink->max - sink->len)
+		len = sink->max - sink->len;
+	if(sink->len + len + 1 <= sink->size)
+		return 0;
+
+	tmp = realloc(sink->buf, sink->len + len + 1);
+	if(tmp == NULL)
+		{
+		errorSource = ERRNO;
+		return -1;
+		}
+	sink->buf = tmp;
+	sink->size = sink->len + len + 1;
+	return 0;
+	}
+
+
+
+	/*
+	 * Takes the next len bytes of a body: keeps what fits, or hands them
+	 *	to the callback.  An allocated buffer grows by doubling.
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_sink_put(struct _http_sink *sink, const char *data, int len)
+	{
+	int keep, size;
+	char *tmp;
+
+	if(len <= 0)
+		return 0;
+	sink->total += len;
+
+	switch(sink->mode)
+		{
+		case SINK_DISCARD:
+			return 0;
+
+		case SINK_CALLBACK:
+			if(sink->cb(sink->arg, data, len) != 0)
+				{
+				errorSource = FETCHER_ERROR;
+				http_errno = HF_CALLBACK;
+				return -1;
+				}
+			return 0;
+
+		case SINK_FIXED:
+			keep = sink->size - 1 - sink->len;
+			break;
+
+		default:
+			keep = sink->max > 0 ? sink->max - sink->len : len;
+			if(keep > len)
+				keep = len;
+			if(sink->len + keep + 1 > sink->size)
+				{
+				size = sink->size * 2 > REQUEST_BUF_SIZE ? sink->size * 2 :
+					REQUEST_BUF_SIZE;
+				if(size < sink->len + keep + 1)
+					size = sink->len + keep + 1;
+				if(sink->max > 0 && size > sink->max + 1)
+					size = sink->max + 1;
+				tmp = realloc(sink->buf, size);
+				if(tmp == NULL)
+					{
+					errorSource = ERRNO;
+					return -1;
+					}
+				sink->buf = tmp;
+				sink->size = size;
+				}
+			break;
+		}
+
+	if(keep > len)
+		keep = len;
+	memcpy(sink->buf + sink->len, data, keep);
+	sink->len += keep;
+	return 0;
+	}
+
+
+
+	/*
+	 * Finishes the body.  Note that we add one NULL byte to the end of the
+	 *	data, as it may not already be NULL terminated and we can't be sure
+	 *	what type of data it is or what the caller will do with it.  An
+	 *	allocated buffer is trimmed to the data.
+	 * Returns:
+	 *	# of bytes kept for SINK_FIXED and SINK_ALLOC, or
+	 *	# of body bytes for SINK_DISCARD and SINK_CALLBACK, or
+	 *	-1 on error
+	 */
+int _http_sink_done(struct _http_sink *sink)
+	{
+	char *tmp;
+
+	if(sink->mode == SINK_ALLOC)
+		{
+		tmp = realloc(sink->buf, sink->len + 1);
+		if(tmp == NULL)
+			{
+			errorSource = ERRNO;
+			_http_sink_free(sink);
+			return -1;
+			}
+		sink->buf = tmp;
+		sink->size = sink->len + 1;
+		}
+	else if(sink->mode != SINK_FIXED)
+		return sink->total;
+
+	sink->buf[sink->len] = '\0';  /* NULL terminate the data */
+	return sink->len;
+	}
+
+
+
+	/*
+	 * Drops an allocated body after an error
+	 */
+void _http_sink_free(struct _http_sink *sink)
+	{
+	if(sink->mode == SINK_ALLOC)
+		{
+		free(sink->buf);
+		sink->buf = NULL;
+		sink->len = sink->size = 0;
+		}
+	}
+
+
+
+	/*
+	 * Looks up host and port, from the cache while the entry is fresh.  A
+	 *	failed lookup is cached too, so a missing host doesn't ask the
+	 *	resolver on every request.  When the resolver can't be reached the
+	 *	last good address is used further, for dnsFailTTL seconds at a time.
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_resolve(const char *host, const char *port,
+		struct sockaddr_storage *addr, socklen_t *addrlen)
+	{
+	struct addrinfo hints, *res;
+	time_t now = time(NULL);
+	int i, ret, slot = -1;
+
+	for(i = 0; i < DNS_CACHE_SIZE; i++)
+		if(strcmp(dnsCache[i].host, host) == 0 &&
+				strcmp(dnsCache[i].port, port) == 0)
+			{
+			slot = i;
+			break;
+			}
+
+	if(slot >= 0 && now < dnsCache[slot].expires)
+		{
+		if(dnsCache[slot].addrlen == 0)
+			{
+			errorSource = GAI_ERRNO;
+			errorInt = dnsCache[slot].error;
+			return -1;
+			}
+		memcpy(addr, &dnsCache[slot].addr, dnsCache[slot].addrlen);
+		*addrlen = dnsCache[slot].addrlen;
+		return 0;
+		}
+
+	memset(&hints, 0, sizeof(hints));
+ 	hints.ai_socktype = SOCK_STREAM;
+ 	hints.ai_family = AF_INET;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+
+	if(slot < 0)
+		{
+		/* New entry, replaces the one expiring first */
+		slot = 0;
+		for(i = 1; i < DNS_CACHE_SIZE; i++)
+			if(dnsCache[i].expires < dnsCache[slot].expires)
+				slot = i;
+		strncpy(dnsCache[slot].host, host, HOST_BUF_SIZE - 1);
+		dnsCache[slot].host[HOST_BUF_SIZE - 1] = '\0';
+		strncpy(dnsCache[slot].port, port, sizeof(dnsCache[slot].port) - 1);
+		dnsCache[slot].port[sizeof(dnsCache[slot].port) - 1] = '\0';
+		dnsCache[slot].addrlen = 0;
+		}
+
+	if(ret == 0)
+		{
+		memcpy(&dnsCache[slot].addr, res->ai_addr, res->ai_addrlen);
+		dnsCache[slot].addrlen = res->ai_addrlen;
+		dnsCache[slot].expires = now + dnsTTL;
+		freeaddrinfo(res);
+		}
+	else if(dnsCache[slot].addrlen > 0 &&
+			(ret == EAI_AGAIN || ret == EAI_FAIL || ret == EAI_SYSTEM))
+		{
+		/* Resolver unreachable, go on with the last good address */
+		dnsCache[slot].expires = now + dnsFailTTL;
+		}
+	else
+		{
+		dnsCache[slot].addrlen = 0;
+		dnsCache[slot].error = ret;
+		dnsCache[slot].expires = now + dnsFailTTL;
+		errorSource = GAI_ERRNO;
+		errorInt = ret;
+		return -1;
+		}
+
+	memcpy(addr, &dnsCache[slot].addr, dnsCache[slot].addrlen);
+	*addrlen = dnsCache[slot].addrlen;
+	return 0;
+	}
+
+
+
+	/*
+	 * Drops the cached address of host and port, the next request asks the
+	 *	resolver again
+	 */
+void _http_resolve_forget(const char *host, const char *port)
+	{
+	int i;
+
+	for(i = 0; i < DNS_CACHE_SIZE; i++)
+		if(strcmp(dnsCache[i].host, host) == 0 &&
+				strcmp(dnsCache[i].port, port) == 0 &&
+				dnsCache[i].addrlen > 0)
+			dnsCache[i].expires = 0;
+	}
+
+
+
+	/* State of a request of http_fetch_multi() */
+struct _http_job
+	{
+	struct http_request *req;
+	struct _http_sink sink;		/* Where the body goes */
+	char *url;					/* Copy of the url or the redirect target */
+	char host[HOST_BUF_SIZE];	/* host[:port] for the pool */
+	char *request;				/* The request and how much of it is sent */
+	int sent;
+	int sock;					/* -1 when the job is finished */
+	int reused, redirects, received;
+	long deadline;				/* ms on the monotonic clock, 0 for none */
+	char *location;				/* Target of a redirect */
+	char buf[HEADER_BUF_SIZE + READ_BUF_SIZE];	/* Unparsed part of the response */
+	int len;
+	int scanned, newlines;		/* Search for the end of the metadata */
+	int header;					/* Set when the metadata is parsed */
+	int status, chunked, reuse;
+	int contentLength;			/* Body bytes still to come, -1 if unknown */
+	int chunkState, chunkLeft;	/* Chunked decoding */
+	};
+
+#define CHUNK_SIZE		0		/* Chunk size line */
+#define CHUNK_DATA		1		/* chunkLeft bytes of chunk data */
+#define CHUNK_END		2		/* Line end after the chunk data */
+#define CHUNK_TRAILER	3		/* Trailer up to the empty line */
+
+
+
+	/*
+	 * Fetches all n urls at once: every request gets its own connection
+	 *	(a pooled one if there is any), connects, sends and receives are
+	 *	nonblocking and driven by one epoll loop, so the whole batch takes
+	 *	about as long as the slowest server.  Redirects, keep-alive and the
+	 *	timeout work like with http_fetch().  The body goes through a fixed
+	 *	buffer per request, only what the caller keeps is allocated.
+	 * Returns:
+	 *	# of successful requests, or
+	 *	-1 on error (no request was made)
+	 */
+int http_fetch_multi(struct http_request *req, int n)
+	{
+	struct epoll_event events[16];
+	struct _http_job *jobs;
+	int epfd, i, ret, active = 0, done = 0, wait;
+	long now;
+
+	jobs = calloc(n > 0 ? n : 1, sizeof(*jobs));
+	if(jobs == NULL)
+		{
+		errorSource = ERRNO;
+		return -1;
+		}
+	epfd = epoll_create(n > 0 ? n : 1);
+	if(epfd == -1)
+		{
+		free(jobs);
+		errorSource = ERRNO;
+		return -1;
+		}
+
+	for(i = 0; i < n; i++)
+		{
+		req[i].body = NULL;
+		req[i].length = -1;
+		req[i].error[0] = '\0';
+		jobs[i].req = &req[i];
+		jobs[i].sock = -1;
+		_http_sink_init(&jobs[i].sink, req[i].maxBody < 0 ? SINK_DISCARD :
+			SINK_ALLOC, NULL, req[i].maxBody > 0 ? req[i].maxBody : 0);
+		jobs[i].url = req[i].url != NULL ? strdup(req[i].url) : NULL;
+		if(jobs[i].url == NULL)
+			{
+			errorSource = req[i].url == NULL ? FETCHER_ERROR : ERRNO;
+			http_errno = HF_NULLURL;
+			_http_job_finish(&jobs[i], -1);
+			continue;
+			}
+		if(_http_job_start(&jobs[i], epfd, 0) == 0)
+			active++;
+		}
+
+	while(active > 0)
+		{
+		/* Wait until the next event or the earliest timeout */
+		now = _http_ms();
+		wait = -1;
+		for(i = 0; i < n; i++)
+			{
+			if(jobs[i].sock == -1 || jobs[i].deadline == 0)
+				continue;
+			if(jobs[i].deadline <= now)
+				{
+				errorSource = FETCHER_ERROR;
+				http_errno = jobs[i].header ? HF_DATATIMEOUT : HF_HEADTIMEOUT;
+				errorInt = timeout;
+				_http_job_finish(&jobs[i], -1);
+				active--;
+				}
+			else if(wait == -1 || jobs[i].deadline - now < wait)
+				wait = jobs[i].deadline - now;
+			}
+		if(active == 0)
+			break;
+
+		ret = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), wait);
+		if(ret == -1)
+			{
+			if(errno == EINTR)
+				continue;
+			errorSource = ERRNO;
+			for(i = 0; i < n; i++)
+				if(jobs[i].sock != -1)
+					_http_job_finish(&jobs[i], -1);
+			break;
+			}
+		for(i = 0; i < ret; i++)
+			if(_http_job_event(events[i].data.ptr, epfd, events[i].events))
+				active--;
+		}
+
+	for(i = 0; i < n; i++)
+		if(req[i].length >= 0)
+			done++;
+	close(epfd);
+	free(jobs);
+	return done;
+	}
+
+
+
+	/*
+	 * Milliseconds on the monotonic clock
+	 */
+long _http_ms(void)
+	{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+	}
+
+
+
+	/*
+	 * (Re)starts a job on job->url: composes the request and takes a pooled
+	 *	connection, or opens a new one with fresh set
+	 * Returns:
+	 *	0 if the job is under way, or
+	 *	-1 if it failed (and is finished)
+	 */
+int _http_job_start(struct _http_job *job, int epfd, int fresh)
+	{
+	struct epoll_event ev;
+	char hostBuf[HOST_BUF_SIZE], *host, *path;
+
+	/* Seek to the file path portion of the url */
+	host = strstr(job->url, "://");
+	host = host != NULL ? host + strlen("://") : job->url;
+	path = strchr(host, '/');
+
+	free(job->request);
+	job->request = _http_request(host, path);
+	if(job->request == NULL)	/* errorSource set within */
+		return _http_job_finish(job, -1);
+	job->sent = 0;
+
+	/* Keep host[:port] for the pool, _http_connect() cuts off the port */
+	snprintf(job->host, HOST_BUF_SIZE, "%.*s",
+		path != NULL ? (int)(path - host) : (int)strlen(host), host);
+	strcpy(hostBuf, job->host);
+
+	job->sock = fresh ? -1 : _http_pool_take(job->host);
+	job->reused = job->sock != -1;
+	if(job->reused)
+		fcntl(job->sock, F_SETFL, fcntl(job->sock, F_GETFL) | O_NONBLOCK);
+	else
+		job->sock = _http_connect(hostBuf, 1);
+	if(job->sock == -1)		/* errorSource set within */
+		return _http_job_finish(job, -1);
+
+	free(job->location);
+	job->location = NULL;
+	job->len = job->received = 0;
+	job->scanned = job->newlines = job->header = 0;
+	job->contentLength = -1;
+	job->chunkState = CHUNK_SIZE;
+	job->deadline = timeout >= 0 ? _http_ms() + timeout * 1000L : 0;
+
+	/* Writable once connected */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.ptr = job;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, job->sock, &ev) == -1)
+		{
+		errorSource = ERRNO;
+		return _http_job_finish(job, -1);
+		}
+	return 0;
+	}
+
+
+
+	/*
+	 * Handles epoll events of a job: finishes the connect, sends the
+	 *	request and reads what has arrived of the response.  An error or
+	 *	hangup of the socket ends the attempt with the SO_ERROR reason, a
+	 *	hangup while the response is read is left to read(), the rest of
+	 *	the response may still be waiting before the end of file.
+	 * Returns:
+	 *	1 if the job is finished, or
+	 *	0 if it goes on
+	 */
+int _http_job_event(struct _http_job *job, int epfd, unsigned int events)
+	{
+	struct epoll_event ev;
+	socklen_t optlen = sizeof(int);
+	int ret, err = 0;
+
+	if(job->sock == -1)
+		return 0;
+
+	if((events & EPOLLERR) ||
+		((events & EPOLLHUP) && job->sent < (int)strlen(job->request)))
+		{
+		if(getsockopt(job->sock, SOL_SOCKET, SO_ERROR, &err, &optlen) == -1)
+			err = errno;
+		errno = err != 0 ? err : ECONNRESET;
+		errorSource = ERRNO;
+		/* A failed connect, the address may be stale */
+		if(!job->reused && job->sent == 0)
+			_http_resolve_forget(job->host, strchr(job->host, ':') ?
+				strchr(job->host, ':') + 1 : PORT_NUMBER);
+		return _http_job_retry(job, epfd);
+		}
+
+	if(job->sent < (int)strlen(job->request))
+		{
+		ret = send(job->sock, job->request + job->sent,
+			strlen(job->request) - job->sent, MSG_NOSIGNAL);
+		if(ret == -1)
+			{
+			if(errno == EAGAIN || errno == EINTR)
+				return 0;
+			errorSource = ERRNO;
+			return _http_job_retry(job, epfd);
+			}
+		job->sent += ret;
+		if(job->sent == (int)strlen(job->request))
+			{
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.ptr = job;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, job->sock, &ev);
+			}
+		if(timeout >= 0)
+			job->deadline = _http_ms() + timeout * 1000L;
+		return 0;
+		}
+
+	/* Leave room for the NULL byte */
+	ret = read(job->sock, job->buf + job->len, sizeof(job->buf) - 1 - job->len);
+	if(ret == -1)
+		{
+		if(errno == EAGAIN || errno == EINTR)
+			return 0;
+		errorSource = ERRNO;
+		return _http_job_retry(job, epfd);
+		}
+	if(ret == 0)
+		{
+		/* Without a length the body ends when the server closes */
+		if(job->header && job->contentLength < 0 && !job->chunked)
+			{
+			job->reuse = 0;
+			return _http_job_done(job, epfd);
+			}
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_CONNCLOSED;
+		return _http_job_retry(job, epfd);
+		}
+	job->len += ret;
+	job->received += ret;
+	job->buf[job->len] = '\0';
+	if(timeout >= 0)
+		job->deadline = _http_ms() + timeout * 1000L;
+
+	ret = _http_job_parse(job);
+	if(ret < 0)
+		return _http_job_finish(job, -1);
+	if(ret > 0)
+		return _http_job_done(job, epfd);
+	return 0;
+	}
+
+
+
+	/*
+	 * Parses what has arrived of the response: the metadata once it is
+	 *	complete, then the body as far as it has come.  Body bytes go to
+	 *	the sink and are dropped from job->buf, only a partial line of the
+	 *	chunked coding stays there.
+	 * Returns:
+	 *	1 if the response is complete, 
+	 *	0 if more is needed, or
+	 *	-1 on error
+	 */
+int _http_job_parse(struct _http_job *job)
+	{
+	char *p, *eol, *end, c;
+	long size;
+	int pos = 0, n, ret = 0;
+
+	if(!job->header)
+		{
+		/* The metadata ends with an empty line, CR are ignored */
+		while(job->newlines < 2 && job->scanned < job->len)
+			{
+			c = job->buf[job->scanned++];
+			if(c == '\n')
+				job->newlines++;
+			else if(c != '\r')
+				job->newlines = 0;
+			}
+		if(job->newlines < 2 && job->len < HEADER_BUF_SIZE)
+			return 0;
+		if(job->newlines < 2 || job->scanned >= HEADER_BUF_SIZE)
+			{
+			errorSource = FETCHER_ERROR;
+			http_errno = HF_HEADTOOLONG;
+			errorInt = HEADER_BUF_SIZE;
+			return -1;
+			}
+
+		c = job->buf[job->scanned];
+		job->buf[job->scanned] = '\0';
+		ret = _http_job_header(job);
+		job->buf[job->scanned] = c;
+		if(ret != 0)
+			return ret;
+		job->header = 1;
+		pos = job->scanned;
+		}
+
+	if(job->contentLength >= 0)
+		{
+		n = job->len - pos;
+		if(n > job->contentLength)
+			{
+			n = job->contentLength;
+			job->reuse = 0;		/* More than announced, don't trust it */
+			}
+		if(_http_sink_put(&job->sink, job->buf + pos, n) < 0)
+			return -1;
+		job->contentLength -= n;
+		job->len = 0;
+		return job->contentLength == 0;
+		}
+	if(!job->chunked)
+		{
+		/* Up to the end of the connection */
+		if(_http_sink_put(&job->sink, job->buf + pos, job->len - pos) < 0)
+			return -1;
+		job->len = 0;
+		return 0;
+		}
+
+	for(;;)
+		{
+		p = job->buf + pos;
+		if(job->chunkState == CHUNK_DATA)
+			{
+			n = job->len - pos;
+			if(n > job->chunkLeft)
+				n = job->chunkLeft;
+			if(_http_sink_put(&job->sink, p, n) < 0)
+				return -1;
+			pos += n;
+			job->chunkLeft -= n;
+			if(job->chunkLeft > 0)
+				break;
+			job->chunkState = CHUNK_END;
+			continue;
+			}
+
+		eol = memchr(p, '\n', job->len - pos);
+		if(eol == NULL)
+			{
+			if(job->len - pos < HEADER_BUF_SIZE)
+				break;
+			errorSource = FETCHER_ERROR;
+			http_errno = HF_CHUNKED;
+			return -1;
+			}
+		pos = eol + 1 - job->buf;
+
+		if(job->chunkState == CHUNK_END)
+			job->chunkState = CHUNK_SIZE;
+		else if(job->chunkState == CHUNK_TRAILER)
+			{
+			/* Skip the trailer up to the empty line */
+			if(eol == p || (eol == p + 1 && *p == '\r'))
+				{
+				if(pos < job->len)
+					job->reuse = 0;
+				ret = 1;
+				break;
+				}
+			}
+		else
+			{
+			size = strtol(p, &end, 16);
+			if(end == p || size < 0 || size > DEFAULT_PAGE_BUF_SIZE * 50)
+				{
+				errorSource = FETCHER_ERROR;
+				http_errno = HF_CHUNKED;
+				return -1;
+				}
+			job->chunkLeft = size;
+			job->chunkState = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+			}
+		}
+
+	/* Keep the partial line for the next read */
+	memmove(job->buf, job->buf + pos, job->len - pos);
+	job->len -= pos;
+	return ret;
+	}
+
+
+
+	/*
+	 * Parses the metadata NULL terminated in job->buf
+	 * Returns:
+	 *	1 if there is no body to read (a redirect), 
+	 *	0 if the body follows, or
+	 *	-1 on error
+	 */
+int _http_job_header(struct _http_job *job)
+	{
+	char *p;
+	int i;
+
+	job->status = _http_status(job->buf);
+	if(job->status == -1)
+		return -1;		/* errorSource set within */
+
+	job->reuse = keepAlive > 0;
+	p = _http_header(job->buf, "Connection");
+	if(p != NULL && strncasecmp(p, "close", 5) == 0)
+		job->reuse = 0;
+	if(strncmp(job->buf, "HTTP/1.0", 8) == 0 &&
+			(p == NULL || strncasecmp(p, "keep-alive", 10) != 0))
+		job->reuse = 0;
+
+	p = _http_header(job->buf, "Transfer-Encoding");
+	job->chunked = p != NULL && strncasecmp(p, "chunked", 7) == 0;
+
+	p = _http_header(job->buf, "Content-Length");
+	if(p != NULL && !job->chunked &&
+			(sscanf(p, "%d", &job->contentLength) < 1 || job->contentLength < 0))
+		{
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_CONTENTLEN;
+		return -1;
+		}
+	if(job->status == 204 || job->status == 304)	/* Never have a body */
+		{
+		job->chunked = 0;
+		job->contentLength = 0;
+		}
+	if(job->contentLength > 0 && _http_sink_reserve(&job->sink, job->contentLength) < 0)
+		return -1;
+
+	if(job->status < 300 || job->status > 307)
+		return 0;
+
+	/* The body of a redirect is not read */
+	p = _http_header(job->buf, "Location");
+	if(p == NULL || *p == '\0')
+		{
+		errorInt = job->status;
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_CANTREDIRECT;
+		return -1;
+		}
+	i = strcspn(p, " \r\n");
+	if(i == 0)
+		return 0;	/* Found 'Location:' but contains no URL, the page is the result */
+	job->location = strndup(p, i);
+	if(job->location == NULL)
+		{
+		errorSource = ERRNO;
+		return -1;
+		}
+	return 1;
+	}
+
+
+
+	/*
+	 * A complete response: checks the status, follows a redirect or hands
+	 *	the body to the caller
+	 * Returns:
+	 *	1 if the job is finished, or
+	 *	0 if it goes on with a redirect
+	 */
+int _http_job_done(struct _http_job *job, int epfd)
+	{
+	if(job->status < 200 || job->status > 307)
+		{
+		errorInt = job->status;	/* Status code, to be inserted in error string */
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_STATUSCODE;
+		return _http_job_finish(job, -1);
+		}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, job->sock, NULL);
+	if(job->location == NULL)
+		return _http_job_finish(job, _http_sink_done(&job->sink));
+
+	if(followRedirects >= 0 && job->redirects >= followRedirects)
+		{
+		errorInt = followRedirects;
+		errorSource = FETCHER_ERROR;
+		http_errno = HF_MAXREDIRECTS;
+		return _http_job_finish(job, -1);
+		}
+	job->redirects++;
+	free(job->url);
+	job->url = job->location;
+	job->location = NULL;
+	close(job->sock);	/* The redirect body is not read */
+	job->sock = -1;
+	return _http_job_start(job, epfd, 0) == 0 ? 0 : 1;
+	}
+
+
+
+	/*
+	 * A reused connection may have been closed by the server in the
+	 *	meantime, then the request is sent once more on a new connection
+	 * Returns:
+	 *	1 if the job is finished, or
+	 *	0 if it goes on
+	 */
+int _http_job_retry(struct _http_job *job, int epfd)
+	{
+	if(!job->reused || job->received > 0)
+		return _http_job_finish(job, -1);
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, job->sock, NULL);
+	close(job->sock);
+	job->sock = -1;
+	return _http_job_start(job, epfd, 1) == 0 ? 0 : 1;
+	}
+
+
+
+	/*
+	 * Finishes a job with the body length, or -1 and the current error
+	 *	message.  The connection goes back to the pool if it can be reused.
+	 * Returns:
+	 *	1 (the job is finished)
+	 */
+int _http_job_finish(struct _http_job *job, int length)
+	{
+	struct http_request *req = job->req;
+
+	if(length >= 0)
+		{
+		req->body = job->sink.mode == SINK_ALLOC ? job->sink.buf : NULL;
+		req->length = length;
+		if(job->reuse)
+			{
+			fcntl(job->sock, F_SETFL, fcntl(job->sock, F_GETFL) & ~O_NONBLOCK);
+			_http_pool_put(job->host, job->sock);
+			}
+		else
+			close(job->sock);
+		}
+	else
+		{
+		strncpy(req->error, http_strerror(), sizeof(req->error) - 1);
+		req->error[sizeof(req->error) - 1] = '\0';
+		_http_sink_free(&job->sink);
+		if(job->sock != -1)
+			close(job->sock);
+		}
+
+	job->sock = -1;
+	free(job->url);
+	free(job->request);
+	free(job->location);
+	job->url = job->request = job->location = NULL;
+	return 1;
+	}
@@ -22,18 +22,46 @@
 #ifndef HTTP_FETCHER_H
 #define HTTP_FETCHER_H
 
+#include <sys/socket.h>
 #include "http_error_codes.h"
 
 #define PORT_NUMBER 			"80"
-#define HTTP_VERSION 			"HTTP/1.0"
+#define HTTP_VERSION 			"HTTP/1.1"
 #define DEFAULT_USER_AGENT		"HTTP Fetcher"
 #define DEFAULT_READ_TIMEOUT	30		/* Seconds to wait before giving up
 										 *	when no data is arriving */
 	 
 #define REQUEST_BUF_SIZE 		1024
 #define HEADER_BUF_SIZE 		1024
+#define READ_BUF_SIZE			4096	/* Block size of buffered reads */
 #define DEFAULT_PAGE_BUF_SIZE 	1024 * 200	/* 200K should hold most things */
 #define DEFAULT_REDIRECTS       3       /* Number of HTTP redirects to follow */
+#define DEFAULT_KEEPALIVE		15		/* Seconds an idle connection is kept */
+#define POOL_SIZE				8		/* Connections kept open at most */
+#define DEFAULT_DNS_TTL			300		/* Seconds a resolved address is kept */
+#define DEFAULT_DNS_FAIL_TTL	30		/* Seconds a failed lookup is kept */
+#define DNS_CACHE_SIZE			16
+#define HOST_BUF_SIZE			320		/* host:port of a pooled connection */
+
+
+
+	/* One request of http_fetch_multi() */
+struct http_request
+	{
+	const char *url;		/* The url to fetch */
+	int maxBody;			/* Bytes of the body to keep, 0 for all of it
+							 *	or -1 to drop it (only the status counts) */
+	char *body;				/* Set to the downloaded page with a NULL byte
+							 *	added (free it), or NULL on error or if
+							 *	the body is dropped */
+	int length;				/* # of bytes kept (downloaded if dropped),
+							 *	or -1 on error */
+	char error[128];		/* Error message if length is -1 */
+	};
+
+	/* Takes the body of http_fetch_cb() part by part, returns 0 to go on
+	 *	or -1 to give up the download */
+typedef int (*http_body_cb)(void *arg, const char *data, int len);
 
 
 
@@ -50,16 +78,49 @@
 
 	/*
 	 * Download the page, registering a hit. If you pass it a NULL for fileBuf,
-	 *	'url' will be requested but will not remain in memory (useful for
-	 *	simply registering a hit).  Otherwise necessary space will be allocated
-	 *	and will be pointed to by fileBuf.  Note that a NULL byte is added to
-     *  the data, so the actual buffer will be the file size + 1.
+	 *	'url' will be requested but the body is read without being kept
+	 *	(useful for simply registering a hit).  Otherwise necessary space will
+	 *	be allocated and will be pointed to by fileBuf.  Note that a NULL byte
+     *  is added to the data, so the actual buffer will be the file size + 1.
 	 * Returns:
 	 *	# of bytes downloaded, or
 	 *	-1 on error
 	 */
 int http_fetch(const char *url, char **fileBuf);
 
+	/*
+	 * Download the page into buf of size bytes.  At most size-1 bytes are
+	 *	kept and a NULL byte is added, the rest of the body is read and
+	 *	dropped.  Nothing is allocated for the body.
+	 * Returns:
+	 *	# of bytes kept in buf, or
+	 *	-1 on error
+	 */
+int http_fetch_buf(const char *url, char *buf, int size);
+
+	/*
+	 * Download the page handing it to cb part by part as it arrives,
+	 *	nothing is allocated for the body.  If cb returns non-zero the
+	 *	download stops with an error.
+	 * Returns:
+	 *	# of bytes downloaded, or
+	 *	-1 on error
+	 */
+int http_fetch_cb(const char *url, http_body_cb cb, void *arg);
+
+	/*
+	 * Downloads n pages at once: the requests are sent to all servers
+	 *	concurrently, so the batch takes about as long as the slowest
+	 *	server, not as all of them together.  Each request gets its body
+	 *	(at most maxBody bytes, none if maxBody is -1), length and error
+	 *	message like from http_fetch() and http_strerror().
+	 *	The timeout applies to each request on its own.
+	 * Returns:
+	 *	# of successful requests, or
+	 *	-1 on error (no request was made)
+	 */
+int http_fetch_multi(struct http_request *req, int n);
+
 	/*
 	 * Changes the User Agent (shown to the web server with each request)
 	 *	Send it NULL to avoid telling the server a User Agent
@@ -89,6 +150,28 @@ int http_setReferer(const char *newReferer);
 	 */
 void http_setTimeout(int seconds);
 
+	/*
+	 * Changes how many seconds a connection is kept open after a request,
+	 *	so the next request to the same host[:port] skips the connect.
+	 *	Connections are kept only if the response length was known
+	 *	(Content-Length or chunked) and the server didn't ask to close.
+	 *	Pass 0 to close connections after each request like HTTP/1.0
+	 */
+void http_setKeepAlive(int seconds);
+
+	/*
+	 * Closes all connections kept open for reuse
+	 */
+void http_closeConnections(void);
+
+	/*
+	 * Changes how many seconds resolved host addresses (default 300) and
+	 *	failed lookups (default 30) are cached.  If the resolver can't be
+	 *	reached, the last good address is used further.  Pass 0, 0 to
+	 *	resolve on every request.
+	 */
+void http_setResolverTTL(int seconds, int failSeconds);
+
 	/*
 	 * Changes the number of HTTP redirects HTTP Fetcher will automatically
 	 *	follow.  If a request returns a status code of 3XX and contains
@@ -132,13 +215,23 @@ const char *http_strerror();
 /**** The following functions are used INTERNALLY by http_fetcher *************/
 /******************************************************************************/
 
+	/* Buffered reads of a response, what was read beyond the part needed
+	 *	stays in buf for the next read */
+struct _http_reader
+	{
+	int sock;
+	int pos, len;				/* Unread bytes are buf[pos] to buf[len-1] */
+	int received;				/* Bytes read from the socket so far */
+	char buf[READ_BUF_SIZE];
+	};
+
 	/*
 	 * Reads the metadata of an HTTP response.  On success returns the number
 	 * Returns:
 	 *	# of bytes read on success, or
 	 *	-1 on error
 	 */
-int _http_read_header(int sock, char *headerPtr);
+int _http_read_header(struct _http_reader *rd, char *headerPtr);
 
 	/*
 	 * Opens a TCP socket and returns the descriptor
@@ -147,6 +240,18 @@ int _http_read_header(int sock, char *headerPtr);
 	 *	-1 on error
 	 */
 int makeSocket(const char *host);
+int _http_connect(const char *host, int nonblocking);
+
+	/*
+	 * Resolver cache: looks up host and port, or drops the cached address
+	 *	after it failed to connect
+	 * Returns:
+	 *	0 on success, or
+	 *	-1 on error
+	 */
+int _http_resolve(const char *host, const char *port,
+		struct sockaddr_storage *addr, socklen_t *addrlen);
+void _http_resolve_forget(const char *host, const char *port);
 
 	/*
 	 * Determines if the given NULL-terminated buffer is large enough to
@@ -158,4 +263,97 @@ int makeSocket(const char *host);
 	 */
 int _checkBufSize(char **buf, int *bufsize, int more);
 
+	/*
+	 * Connection pool: returns a healthy pooled connection to host[:port]
+	 *	(*reused set) or a new one, and takes a connection back
+	 */
+int _http_pool_get(const char *host, int *reused);
+int _http_pool_take(const char *host);
+void _http_pool_put(const char *host, int sock);
+
+	/*
+	 * Socket helpers honouring the read timeout.
+	 * Returns:
+	 *	0 (or the line/body length) on success, or
+	 *	-1 on error
+	 */
+int _http_write(int sock, const char *buf, int len);
+int _http_fill(struct _http_reader *rd, int timeoutError);
+int _http_read_line(struct _http_reader *rd, char *line, int size);
+
+	/*
+	 * Where the body of a response goes: a buffer allocated as needed
+	 *	(up to max bytes if max is set), the caller's buffer, nowhere or
+	 *	a callback.  Body bytes that don't fit are dropped.
+	 */
+#define SINK_DISCARD	0
+#define SINK_ALLOC		1
+#define SINK_FIXED		2
+#define SINK_CALLBACK	3
+
+struct _http_sink
+	{
+	int mode;
+	char *buf;					/* The body kept, NULL terminated when done */
+	int size, len;				/* Size of buf and the bytes kept */
+	int max;					/* SINK_ALLOC: bytes kept at most, 0 for all */
+	int total;					/* Body bytes received */
+	http_body_cb cb;
+	void *arg;
+	};
+
+	/*
+	 * Body readers passing the body to a sink, and the sink itself
+	 * Returns:
+	 *	0 (or the result of _http_sink_done) on success, or
+	 *	-1 on error
+	 */
+int _http_fetch(const char *url, struct _http_sink *sink);
+int _http_fetch_sink(const char *url, struct _http_sink *sink);
+int _http_read_body(struct _http_reader *rd, struct _http_sink *sink, int len);
+int _http_read_chunked(struct _http_reader *rd, struct _http_sink *sink);
+int _http_read_close(struct _http_reader *rd, struct _http_sink *sink);
+void _http_sink_init(struct _http_sink *sink, int mode, char *buf, int size);
+int _http_sink_reserve(struct _http_sink *sink, int len);
+int _http_sink_put(struct _http_sink *sink, const char *data, int len);
+int _http_sink_done(struct _http_sink *sink);
+void _http_sink_free(struct _http_sink *sink);
+
+	/*
+	 * Finds header field 'name' (case insensitive) in the metadata
+	 * Returns:
+	 *	pointer to the field value, or
+	 *	NULL if it is not there
+	 */
+char *_http_header(char *headers, const char *name);
+
+	/*
+	 * Gets the status code from the status line of the metadata
+	 * Returns:
+	 *	the status code, or
+	 *	-1 on error
+	 */
+int _http_status(const char *headers);
+
+	/*
+	 * Composes the GET request for host (up to path) and path
+	 * Returns:
+	 *	the request in a new buffer, or
+	 *	NULL on error
+	 */
+char *_http_request(const char *host, const char *path);
+
+	/*
+	 * Steps of the requests of http_fetch_multi()
+	 */
+struct _http_job;
+long _http_ms(void);
+int _http_job_start(struct _http_job *job, int epfd, int fresh);
+int _http_job_event(struct _http_job *job, int epfd, unsigned int events);
+int _http_job_parse(struct _http_job *job);
+int _http_job_header(struct _http_job *job);
+int _http_job_done(struct _http_job *job, int epfd);
+int _http_job_retry(struct _http_job *job, int epfd);
+int _http_job_finish(struct _http_job *job, int length);
+
 #endif